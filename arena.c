@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGN 8
+
+struct arena_block {
+	struct arena_block *next;
+	// data follows
+};
+
+static void arena_grow(struct arena *a, size_t size)
+{
+	size_t blocksize = ARENA_BLOCK_SIZE;
+	if (size > blocksize - sizeof(struct arena_block))
+		blocksize = size + sizeof(struct arena_block);
+
+	struct arena_block *b = malloc(blocksize);
+	b->next = a->blocks;
+	a->blocks = b;
+	a->ptr = (char*)(b + 1);
+	a->end = (char*)b + blocksize;
+	a->reserved += blocksize;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if ((size_t)(a->end - a->ptr) < size)
+		arena_grow(a, size);
+
+	void *mem = a->ptr;
+	a->ptr += size;
+	a->bytes += size;
+	return mem;
+}
+
+void *arena_realloc(struct arena *a, void *old, size_t oldsize, size_t size)
+{
+	oldsize = (oldsize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (old && size <= oldsize)
+		return old;
+
+	// the most recent allocation can be extended in place
+	if (old && (char*)old + oldsize == a->ptr) {
+		size_t extra = ((size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1)) - oldsize;
+		if ((size_t)(a->end - a->ptr) >= extra) {
+			a->ptr += extra;
+			a->bytes += extra;
+			return old;
+		}
+	}
+
+	void *mem = arena_alloc(a, size);
+	if (old)
+		memcpy(mem, old, oldsize < size ? oldsize : size);
+	return mem;
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *b = a->blocks;
+	while (b) {
+		struct arena_block *next = b->next;
+		free(b);
+		b = next;
+	}
+	memset(a, 0, sizeof(*a));
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bump pointer allocator, everything allocated from it is released at once
+// by arena_free.
+struct arena_block;
+
+struct arena {
+	struct arena_block *blocks;
+	char *ptr;
+	char *end;
+
+	size_t bytes; // handed out, including alignment
+	size_t reserved; // taken from malloc
+};
+
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_realloc(struct arena *a, void *old, size_t oldsize, size_t size);
+void arena_free(struct arena *a);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
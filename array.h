@@ -53,13 +53,7 @@ do {										\
 		if (newsize < capacity)						\
 			newsize = capacity;					\
 										\
-		void *newmem = malloc(newsize * sizeof(array[0]));		\
-		if (array##_n) {						\
-			memcpy(newmem, array, array##_n * sizeof(array[0]));	\
-		}								\
-		if (array)							\
-			free(array);						\
-		array = newmem;							\
+		array = realloc(array, newsize * sizeof(array[0]));		\
 		array##_alloc = newsize;					\
 	}									\
 } while (0)
@@ -131,10 +125,7 @@ do {										\
 		array = 0;							\
 		array##_alloc = 0;						\
 	} else if (array##_n < array##_alloc) {					\
-		void *newmem = malloc(array##_n * sizeof(array[0]));		\
-		memcpy(newmem, array, array##_n * sizeof(array[0]));		\
-		free(array);							\
-		array = newmem;							\
+		array = realloc(array, array##_n * sizeof(array[0]));		\
 		array##_alloc = array##_n;					\
 	}									\
 } while (0)
@@ -147,3 +138,45 @@ do {										\
 	else									\
 		array##_n--;							\
 } while (0)
+
+//-------------------------------------------------------------------------
+// Small arrays keep up to 'size' elements inline, right in the structure
+// they are declared in, and move to the heap only when they outgrow it. Such
+// a structure must not be copied, the array may point into it.
+//-------------------------------------------------------------------------
+
+#define DECLARE_SMALL_ARRAY(type, name, size)					\
+	DECLARE_ARRAY(type, name);						\
+	type name##_inline[size]
+
+#define INIT_SMALL_ARRAY(array)							\
+do {										\
+	array = array##_inline;							\
+	array##_n = 0;								\
+	array##_alloc = sizeof(array##_inline) / sizeof(array##_inline[0]);	\
+} while (0)
+
+#define SMALL_ARRAY_IS_INLINE(array) (array == array##_inline)
+
+#define SMALL_ARRAY_APPEND(array, elt)						\
+do {										\
+	if (array##_n == array##_alloc) {					\
+		size_t newsize = ALLOC_NR(array##_alloc);			\
+		if (SMALL_ARRAY_IS_INLINE(array)) {				\
+			array = malloc(newsize * sizeof(array[0]));		\
+			memcpy(array, array##_inline,				\
+			       array##_n * sizeof(array[0]));			\
+		} else {							\
+			array = realloc(array, newsize * sizeof(array[0]));	\
+		}								\
+		array##_alloc = newsize;					\
+	}									\
+	array[array##_n++] = elt;						\
+} while (0)
+
+#define FREE_SMALL_ARRAY(array)							\
+do {										\
+	if (!SMALL_ARRAY_IS_INLINE(array))					\
+		free(array);							\
+	INIT_SMALL_ARRAY(array);						\
+} while (0)
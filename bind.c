@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "parser.h"
+
+// Name resolution. Every identifier is bound either to a variable slot of
+// its function or to an index into the function table, codegen then works
+// with plain array lookups. A variable is visible from its declaration to
+// the end of its block and may be shadowed in a nested block, parameters
+// belong to the function's block. Other names refer to functions. Every
+// variable gets a slot of its own, even the ones of sibling blocks.
+//
+// Identifiers are shared within a function (see new_ident_expr). The rare
+// one that binds differently at two places, like a function used before a
+// variable of the same name is declared, is copied, along with the shared
+// expressions above it.
+
+// what a declaration has hidden, restored at the end of the block
+struct shadow {
+	unsigned sym;
+	unsigned local;
+	unsigned block;
+};
+
+struct binder {
+	struct binding *b;
+	unsigned *funcs;  // symbol -> function index + 1
+	unsigned *locals; // symbol -> slot + 1, in the current function
+	unsigned *blocks; // symbol -> block of the visible local
+	DECLARE_ARRAY(struct shadow, declared);
+	unsigned block;
+	unsigned nblocks;
+	unsigned nslots;
+	struct stmt *func; // being bound, for error messages
+	int errors;
+};
+
+static void error(struct binder *bd, const char *msg, ...)
+{
+	if (bd->func)
+		fprintf(stderr, "%s: ", sym_name(bd->func->func.ident->ident.sym));
+	va_list args;
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	fputs("\n", stderr);
+	va_end(args);
+	bd->errors++;
+}
+
+static size_t func_nargs(struct stmt *s)
+{
+	return s->func.args ? s->func.args->v_n : 0;
+}
+
+static struct expr *copy_expr(struct binder *bd, struct expr *e)
+{
+	struct expr *c = arena_alloc(&bd->b->arena, sizeof(struct expr));
+	*c = *e;
+	c->consed = 0;
+	return c;
+}
+
+static struct expr *bound(struct binder *bd, struct expr *e, enum bind_kind kind,
+			  unsigned index)
+{
+	if (e->ident.bind != BIND_NONE &&
+	    (e->ident.bind != kind || e->ident.index != index))
+		e = copy_expr(bd, e);
+	e->ident.bind = kind;
+	e->ident.index = index;
+	return e;
+}
+
+static struct expr *declare_local(struct binder *bd, struct expr *ident)
+{
+	unsigned sym = ident->ident.sym;
+	if (bd->locals[sym] && bd->blocks[sym] == bd->block) {
+		error(bd, "Redeclaration of a variable: %s", sym_name(sym));
+		return ident;
+	}
+	struct shadow sh = {sym, bd->locals[sym], bd->blocks[sym]};
+	ARRAY_APPEND(bd->declared, sh);
+	bd->locals[sym] = ++bd->nslots;
+	bd->blocks[sym] = bd->block;
+	return bound(bd, ident, BIND_LOCAL, bd->nslots - 1);
+}
+
+static unsigned open_block(struct binder *bd)
+{
+	unsigned outer = bd->block;
+	bd->block = ++bd->nblocks;
+	return outer;
+}
+
+// forgets the locals declared since 'mark'
+static void close_block(struct binder *bd, size_t mark, unsigned outer)
+{
+	while (bd->declared_n > mark) {
+		struct shadow *sh = &bd->declared[--bd->declared_n];
+		bd->locals[sh->sym] = sh->local;
+		bd->blocks[sh->sym] = sh->block;
+	}
+	bd->block = outer;
+}
+
+static struct expr *bind_use(struct binder *bd, struct expr *e)
+{
+	unsigned sym = e->ident.sym;
+	if (bd->locals[sym])
+		return bound(bd, e, BIND_LOCAL, bd->locals[sym] - 1);
+
+	// a function of no arguments is called by its name alone
+	unsigned f = bd->funcs[sym];
+	if (!f) {
+		error(bd, "Cannot resolve entity: %s", sym_name(sym));
+		return e;
+	}
+	if (func_nargs(bd->b->funcs[f-1]) != 0) {
+		error(bd, "Invalid number of arguments for a function call: %s", sym_name(sym));
+		return e;
+	}
+	return bound(bd, e, BIND_FUNC, f - 1);
+}
+
+static struct expr *bind_expr(struct binder *bd, struct expr *e)
+{
+	struct expr *lhs, *rhs;
+	size_t i;
+
+	switch (e->type) {
+	case EXPR_NUM:
+		break;
+	case EXPR_IDENT:
+		return bind_use(bd, e);
+	case EXPR_BIN:
+		lhs = bind_expr(bd, e->bin.lhs);
+		rhs = bind_expr(bd, e->bin.rhs);
+		if (lhs == e->bin.lhs && rhs == e->bin.rhs)
+			break;
+		if (e->consed)
+			e = copy_expr(bd, e);
+		e->bin.lhs = lhs;
+		e->bin.rhs = rhs;
+		break;
+	case EXPR_CALL:
+	{
+		// calls are never shared, neither are their argument lists
+		struct expr *ident = e->call.ident;
+		unsigned f = bd->funcs[ident->ident.sym];
+		if (!f)
+			error(bd, "Cannot resolve function: %s", sym_name(ident->ident.sym));
+		else if (func_nargs(bd->b->funcs[f-1]) != e->call.args->v_n)
+			error(bd, "Invalid number of arguments for a function call: %s",
+			      sym_name(ident->ident.sym));
+		else
+			e->call.ident = bound(bd, ident, BIND_FUNC, f - 1);
+
+		for (i = 0; i < e->call.args->v_n; i++)
+			e->call.args->v[i] = bind_expr(bd, e->call.args->v[i]);
+		break;
+	}
+	}
+	return e;
+}
+
+static void bind_stmts(struct binder *bd, struct stmts *ss);
+
+static void bind_block(struct binder *bd, struct stmts *ss)
+{
+	size_t mark = bd->declared_n;
+	unsigned outer = open_block(bd);
+	bind_stmts(bd, ss);
+	close_block(bd, mark, outer);
+}
+
+static void bind_stmt(struct binder *bd, struct stmt *s)
+{
+	switch (s->type) {
+	case STMT_EXPR:
+		s->expr = bind_expr(bd, s->expr);
+		break;
+	case STMT_ASSIGN:
+	{
+		unsigned sym = s->assign.ident->ident.sym;
+		s->assign.rhs = bind_expr(bd, s->assign.rhs);
+		if (bd->locals[sym])
+			s->assign.ident = bound(bd, s->assign.ident, BIND_LOCAL,
+						bd->locals[sym] - 1);
+		else
+			error(bd, "Cannot resolve variable: %s", sym_name(sym));
+		break;
+	}
+	case STMT_BLOCK:
+		bind_block(bd, s->block);
+		break;
+	case STMT_IFELSE:
+		s->ifelse.cond = bind_expr(bd, s->ifelse.cond);
+		bind_block(bd, s->ifelse.block->block);
+		if (s->ifelse.elseblock)
+			bind_block(bd, s->ifelse.elseblock->block);
+		break;
+	case STMT_FOR:
+		s->forloop.cond = bind_expr(bd, s->forloop.cond);
+		bind_block(bd, s->forloop.block->block);
+		break;
+	case STMT_FUNC:
+		error(bd, "Nested functions are not supported: %s",
+		      sym_name(s->func.ident->ident.sym));
+		break;
+	case STMT_VAR:
+		// the initializer doesn't see the variable yet
+		if (s->var.init)
+			s->var.init = bind_expr(bd, s->var.init);
+		s->var.ident = declare_local(bd, s->var.ident);
+		break;
+	case STMT_RETURN:
+		if (s->ret)
+			s->ret = bind_expr(bd, s->ret);
+		break;
+	}
+}
+
+static void bind_stmts(struct binder *bd, struct stmts *ss)
+{
+	size_t i;
+	for (i = 0; i < ss->v_n; i++)
+		bind_stmt(bd, ss->v[i]);
+}
+
+static void bind_func(struct binder *bd, struct stmt *s)
+{
+	unsigned sym = s->func.ident->ident.sym;
+	size_t i;
+
+	s->func.ident = bound(bd, s->func.ident, BIND_FUNC, bd->funcs[sym] - 1);
+	if (!s->func.block)
+		return;
+
+	bd->func = s;
+	bd->nslots = 0;
+	unsigned outer = open_block(bd);
+	for (i = 0; i < func_nargs(s); i++)
+		s->func.args->v[i] = declare_local(bd, s->func.args->v[i]);
+	bind_stmts(bd, s->func.block->block);
+	close_block(bd, 0, outer);
+	s->func.nslots = bd->nslots;
+	bd->func = 0;
+}
+
+// Fills the function table. A foreign declaration and a definition of the
+// same function are one entry, the definition.
+static void collect_funcs(struct binder *bd, struct stmts *ss)
+{
+	size_t i;
+	for (i = 0; i < ss->v_n; i++) {
+		struct stmt *s = ss->v[i];
+		if (s->type == STMT_BLOCK) {
+			collect_funcs(bd, s->block);
+			continue;
+		}
+		if (s->type != STMT_FUNC)
+			continue;
+
+		unsigned sym = s->func.ident->ident.sym;
+		unsigned f = bd->funcs[sym];
+		if (!f) {
+			ARRAY_APPEND(bd->b->funcs, s);
+			bd->funcs[sym] = bd->b->funcs_n;
+			continue;
+		}
+
+		struct stmt *prev = bd->b->funcs[f-1];
+		if (func_nargs(prev) != func_nargs(s))
+			error(bd, "Conflicting declarations of a function: %s", sym_name(sym));
+		else if (prev->func.block && s->func.block)
+			error(bd, "Redefinition of a function: %s", sym_name(sym));
+		else if (s->func.block)
+			bd->b->funcs[f-1] = s;
+	}
+}
+
+static void bind_top(struct binder *bd, struct stmts *ss)
+{
+	size_t i;
+	for (i = 0; i < ss->v_n; i++) {
+		struct stmt *s = ss->v[i];
+		if (s->type == STMT_BLOCK)
+			bind_top(bd, s->block);
+		else if (s->type == STMT_FUNC)
+			bind_func(bd, s);
+		else
+			error(bd, "Statements outside of a function are not supported");
+	}
+}
+
+// Returns the number of errors, each one is reported to stderr.
+int bind_ast(struct binding *b, struct stmts *top)
+{
+	struct binder bd;
+	unsigned nsyms = sym_count();
+
+	memset(b, 0, sizeof(*b));
+	INIT_ARRAY(b->funcs, 64);
+
+	memset(&bd, 0, sizeof(bd));
+	bd.b = b;
+	bd.funcs = calloc(nsyms, sizeof(unsigned));
+	bd.locals = calloc(nsyms, sizeof(unsigned));
+	bd.blocks = calloc(nsyms, sizeof(unsigned));
+	INIT_ARRAY(bd.declared, 64);
+
+	collect_funcs(&bd, top);
+	if (!bd.errors)
+		bind_top(&bd, top);
+
+	FREE_ARRAY(bd.declared);
+	free(bd.blocks);
+	free(bd.locals);
+	free(bd.funcs);
+	return bd.errors;
+}
+
+void free_binding(struct binding *b)
+{
+	FREE_ARRAY(b->funcs);
+	arena_free(&b->arena);
+}
@@ -6,12 +6,25 @@ LDFLAGS=`llvm-config --ldflags`
 LIBS=`llvm-config --libs bitwriter nativecodegen`
 
 gcc -o tool/lemon tool/lemon.c
-ragel main.rl
+ragel lexer.rl
 ./tool/lemon grammar.y
 gcc -g -c -o main.o $CFLAGS  main.c
+gcc -g -c -o lexer.o $CFLAGS lexer.c
+gcc -g -c -o compile.o $CFLAGS compile.c
 gcc -g -c -o parser.o $CFLAGS parser.c
+gcc -g -c -o source.o $CFLAGS source.c
+gcc -g -c -o number.o $CFLAGS number.c
+gcc -g -c -o symtab.o $CFLAGS symtab.c
+gcc -g -c -o arena.o $CFLAGS arena.c
+gcc -g -c -o flat.o $CFLAGS flat.c
+gcc -g -c -o cache.o $CFLAGS cache.c
+gcc -g -c -o fold.o $CFLAGS fold.c
+gcc -g -c -o reach.o $CFLAGS reach.c
+gcc -g -c -o bind.o $CFLAGS bind.c
+gcc -g -c -o types.o $CFLAGS types.c
+gcc -g -c -o passes.o $CFLAGS passes.c
 gcc -g -c -o grammar.o $CFLAGS grammar.c
 g++ -std=c++0x -g -c -o codegen.o $CXXFLAGS codegen.cpp
-echo g++ -std=c++0x -g -o ancient main.o parser.o grammar.o codegen.o $LDFLAGS $LIBS -lreadline
-g++ -std=c++0x -g -o ancient main.o parser.o grammar.o codegen.o $LDFLAGS $LIBS -lreadline
+echo g++ -std=c++0x -g -o ancient main.o lexer.o compile.o parser.o source.o number.o symtab.o arena.o flat.o cache.o fold.o reach.o bind.o types.o passes.o grammar.o codegen.o $LDFLAGS $LIBS -lreadline -lpthread
+g++ -std=c++0x -g -o ancient main.o lexer.o compile.o parser.o source.o number.o symtab.o arena.o flat.o cache.o fold.o reach.o bind.o types.o passes.o grammar.o codegen.o $LDFLAGS $LIBS -lreadline -lpthread
 
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "parser.h"
+#include "grammar.h"
+
+// On-disk AST cache. It is the flat AST (see parser.h) written out as is,
+// with symbols replaced by indices into a string table of its own. Loading
+// maps the file and uses the arrays in place, only symbols are patched.
+//
+// layout: header, nums, data, next, kind, string table
+
+#define CACHE_MAGIC "ANCA"
+#define CACHE_VERSION 2
+
+struct cache_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t hash; // of the source
+	uint64_t source_len;
+	uint32_t nnodes;
+	uint32_t nnums;
+	uint32_t nsyms;
+	uint32_t strtab_len;
+};
+
+uint64_t hash_source(const char *buf, size_t len)
+{
+	const uint64_t m = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = len * m;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, buf + i, 8);
+		h = (h ^ w) * m;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+		h = (h ^ (unsigned char)buf[i]) * m;
+	h ^= h >> 32;
+	return h;
+}
+
+static int has_sym(enum flat_kind kind)
+{
+	return kind == FLAT_IDENT || kind == FLAT_CALL;
+}
+
+int save_ast_cache(const char *path, struct flat_ast *fa, uint64_t hash, size_t source_len)
+{
+	// local string table, 'local' maps global symbols to its indices + 1
+	unsigned nsyms = sym_count();
+	unsigned *local = calloc(nsyms, sizeof(unsigned));
+	unsigned *data = malloc(fa->n * sizeof(unsigned));
+	DECLARE_ARRAY(char, strtab);
+	INIT_ARRAY(strtab, 4096);
+
+	struct cache_header h;
+	memcpy(h.magic, CACHE_MAGIC, 4);
+	h.version = CACHE_VERSION;
+	h.hash = hash;
+	h.source_len = source_len;
+	h.nnodes = fa->n;
+	h.nnums = fa->nums_n;
+	h.nsyms = 0;
+
+	size_t i;
+	for (i = 0; i < fa->n; i++) {
+		data[i] = fa->data[i];
+		if (!has_sym(fa->kind[i]))
+			continue;
+
+		unsigned sym = fa->data[i];
+		if (!local[sym]) {
+			int len = sym_len(sym);
+			ENSURE_ARRAY_CAPACITY(strtab, strtab_n + len + 1);
+			memcpy(strtab + strtab_n, sym_name(sym), len + 1);
+			strtab_n += len + 1;
+			local[sym] = ++h.nsyms;
+		}
+		data[i] = local[sym] - 1;
+	}
+	h.strtab_len = strtab_n;
+
+	// write to a temporary file first, so that readers never see half of it
+	size_t pathlen = strlen(path);
+	char *tmp = malloc(pathlen + 5);
+	memcpy(tmp, path, pathlen);
+	memcpy(tmp + pathlen, ".tmp", 5);
+
+	int err = -1;
+	FILE *f = fopen(tmp, "wb");
+	if (f) {
+		fwrite(&h, sizeof(h), 1, f);
+		fwrite(fa->nums, sizeof(double), fa->nums_n, f);
+		fwrite(data, sizeof(unsigned), fa->n, f);
+		fwrite(fa->next, sizeof(unsigned), fa->n, f);
+		fwrite(fa->kind, 1, fa->n, f);
+		fwrite(strtab, 1, strtab_n, f);
+		err = ferror(f);
+		if (fclose(f) || err || rename(tmp, path))
+			err = -1;
+		if (err)
+			unlink(tmp);
+	}
+
+	free(tmp);
+	FREE_ARRAY(strtab);
+	free(data);
+	free(local);
+	return err;
+}
+
+// number of children a node of each kind may have, functions are checked
+// against their argument count
+static const unsigned char min_children[FLAT_RETURN+1] = {
+	[FLAT_BIN] = 2, [FLAT_CALL] = 1, [FLAT_ASSIGN] = 2, [FLAT_BLOCK] = 1,
+	[FLAT_IFELSE] = 2, [FLAT_FOR] = 2, [FLAT_VAR] = 1,
+};
+static const unsigned char max_children[FLAT_RETURN+1] = {
+	[FLAT_BIN] = 2, [FLAT_CALL] = 255, [FLAT_ASSIGN] = 2, [FLAT_BLOCK] = 255,
+	[FLAT_IFELSE] = 3, [FLAT_FOR] = 2, [FLAT_VAR] = 2, [FLAT_RETURN] = 1,
+};
+
+static int is_binop(unsigned tok)
+{
+	return tok == PLUS || tok == MINUS || tok == TIMES || tok == DIVIDE ||
+	       tok == LESS;
+}
+
+static int is_expr(unsigned kind)
+{
+	return kind == FLAT_NUM || kind == FLAT_BIN || kind == FLAT_IDENT ||
+	       kind == FLAT_CALL;
+}
+
+// whether child 'k' of node 'i' may be of 'child' kind, the walkers (see
+// unflatten_stmt) take that for granted
+static int valid_child(struct flat_ast *fa, unsigned i, unsigned k, unsigned child)
+{
+	switch (fa->kind[i]) {
+	case FLAT_BIN:
+	case FLAT_CALL:
+	case FLAT_RETURN:
+		return is_expr(child);
+	case FLAT_ASSIGN:
+	case FLAT_VAR:
+		return k == 0 ? child == FLAT_IDENT : is_expr(child);
+	case FLAT_IFELSE:
+	case FLAT_FOR:
+		return k == 0 ? is_expr(child) : child == FLAT_BLOCK;
+	case FLAT_FUNC:
+		// ident and args, then the block if it has one
+		if (k <= flat_func_nargs(fa, i))
+			return child == FLAT_IDENT;
+		return child == FLAT_BLOCK;
+	}
+	return 1;
+}
+
+static int check_node(struct flat_ast *fa, unsigned i)
+{
+	unsigned n = 0, j;
+	for (j = i+1; j < fa->next[i] && fa->next[j] > j; j = fa->next[j])
+		n++;
+	if (j != fa->next[i])
+		return -1;
+
+	unsigned kind = fa->kind[i];
+	if (kind == FLAT_FUNC) {
+		if (n != flat_func_nargs(fa, i) + 1 && n != flat_func_nargs(fa, i) + 2)
+			return -1;
+	} else if (n < min_children[kind] ||
+		   (max_children[kind] != 255 && n > max_children[kind])) {
+		return -1;
+	}
+
+	unsigned k = 0;
+	for (j = i+1; j < fa->next[i]; j = fa->next[j], k++) {
+		if (fa->kind[j] > FLAT_RETURN || !valid_child(fa, i, k, fa->kind[j]))
+			return -1;
+	}
+	return 0;
+}
+
+// Checks that the tree is well formed, so that walking it can't go out of
+// bounds, and that every node has the number and kinds of children its
+// kind needs. Symbols are patched to global ones on the way.
+static int check_cache(struct flat_ast *fa, const char *strtab, size_t strtab_len,
+		       unsigned nsyms)
+{
+	unsigned *syms = malloc(nsyms * sizeof(unsigned));
+	const char *s = strtab;
+	const char *end = strtab + strtab_len;
+	unsigned i;
+	for (i = 0; i < nsyms; i++) {
+		const char *z = memchr(s, '\0', end - s);
+		if (!z) {
+			free(syms);
+			return -1;
+		}
+		syms[i] = intern(s, z - s);
+		s = z + 1;
+	}
+
+	for (i = 0; i < fa->n; i++) {
+		if (fa->kind[i] > FLAT_RETURN || fa->next[i] <= i || fa->next[i] > fa->n)
+			break;
+		if (fa->kind[i] == FLAT_NUM && fa->data[i] >= fa->nums_n)
+			break;
+		if (fa->kind[i] == FLAT_BIN && !is_binop(fa->data[i]))
+			break;
+		if (check_node(fa, i))
+			break;
+		if (has_sym(fa->kind[i])) {
+			if (fa->data[i] >= nsyms)
+				break;
+			fa->data[i] = syms[fa->data[i]];
+		}
+	}
+	free(syms);
+	if (i != fa->n || fa->n == 0 || fa->kind[0] != FLAT_BLOCK || fa->next[0] != fa->n)
+		return -1;
+	return 0;
+}
+
+struct flat_ast *load_ast_cache(const char *path, uint64_t hash, size_t source_len)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct cache_header)) {
+		close(fd);
+		return 0;
+	}
+
+	// private writable mapping, symbols are patched in place
+	size_t len = st.st_size;
+	char *map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	struct cache_header *h = (struct cache_header*)map;
+	size_t expected = sizeof(*h) + (size_t)h->nnums * sizeof(double) +
+		(size_t)h->nnodes * (2 * sizeof(unsigned) + 1) + h->strtab_len;
+	if (memcmp(h->magic, CACHE_MAGIC, 4) || h->version != CACHE_VERSION ||
+	    h->hash != hash || h->source_len != source_len || expected != len ||
+	    h->nsyms > h->strtab_len) {
+		munmap(map, len);
+		return 0;
+	}
+
+	struct flat_ast *fa = calloc(1, sizeof(struct flat_ast));
+	char *p = map + sizeof(*h);
+	fa->nums = (double*)p;
+	fa->nums_n = fa->nums_alloc = h->nnums;
+	p += h->nnums * sizeof(double);
+	fa->data = (unsigned*)p;
+	p += h->nnodes * sizeof(unsigned);
+	fa->next = (unsigned*)p;
+	p += h->nnodes * sizeof(unsigned);
+	fa->kind = (unsigned char*)p;
+	p += h->nnodes;
+	fa->n = fa->alloc = h->nnodes;
+	fa->map = map;
+	fa->map_len = len;
+
+	if (check_cache(fa, p, h->strtab_len, h->nsyms)) {
+		free_flat_ast(fa);
+		return 0;
+	}
+	return fa;
+}
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-rm -rf *.o *.out grammar.h grammar.c ancient main.c tool/lemon
+rm -rf *.o *.out grammar.h grammar.c ancient lexer.c tool/lemon
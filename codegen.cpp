@@ -1,35 +1,42 @@
 #include <tr1/unordered_map>
-#include <string>
 #include <cstdarg>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/LLVMContext.h>
 #include <llvm/Module.h>
+#include <llvm/PassManager.h>
+#include <llvm/System/Host.h>
+#include <llvm/System/Threading.h>
+#include <llvm/Support/FormattedStream.h>
+#include <llvm/Target/SubtargetFeature.h>
+#include <llvm/Target/TargetData.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetRegistry.h>
+#include <llvm/Target/TargetSelect.h>
 #include "grammar.h"
 #include "parser.h"
 
 using std::tr1::unordered_map;
-using std::string;
 
 extern "C" {
-	LLVMModuleRef codegen(struct stmts *stmts);
+	LLVMModuleRef codegen(LLVMContextRef context, struct stmts *stmts, struct binding *b);
+	LLVMModuleRef codegen_part(LLVMContextRef context, struct binding *b,
+				   const unsigned *funcs, size_t nfuncs);
+	LLVMModuleRef codegen_flat(LLVMContextRef context, struct flat_ast *fa);
+	int codegen_start_threads(void);
+	void codegen_init_target(void);
+	int codegen_target(LLVMModuleRef module, const char *cpu);
+	int codegen_emit(LLVMModuleRef module, const char *cpu, const char *path);
+	const char *codegen_cpu_features(const char *cpu);
+	void codegen_clone(LLVMModuleRef module, struct binding *b,
+			   const unsigned *roots, size_t nroots, int clone);
+	LLVMModuleRef codegen_dispatch(LLVMContextRef context, struct binding *b,
+				       const unsigned *roots, size_t nroots,
+				       const char **cpus, int nclones);
 }
 
-struct Scope {
-	unordered_map<string, llvm::Value*> values;
-
-	llvm::Value *get(const char *name)
-	{
-		auto it = values.find(name);
-		if (it == values.end())
-			return 0;
-		return it->second;
-	}
-
-	void add(const char *name, llvm::Value* value)
-	{
-		values[name] = value;
-	}
-};
-
 //-------------------------------------------------------------------------
 // Helpers and shortcurs
 //-------------------------------------------------------------------------
@@ -43,281 +50,1137 @@ static llvm::Value *errorv(const char *msg ...)
 	return 0;
 }
 
-static const llvm::Type *type_double() { return llvm::Type::getDoubleTy(llvm::getGlobalContext()); }
-static llvm::Value *const_double(double num) { return llvm::ConstantFP::get(type_double(), num); }
-static llvm::StringRef to_ref(struct expr *ident) { return llvm::StringRef(ident->ident.beg, ident->ident.len); }
-static std::string to_string(struct expr *ident) { return std::string(ident->ident.beg, ident->ident.len); }
+static llvm::Value *const_zero(const llvm::Type *type) { return llvm::Constant::getNullValue(type); }
+static llvm::StringRef sym_ref(unsigned sym) { return llvm::StringRef(sym_name(sym), sym_len(sym)); }
 
 //-------------------------------------------------------------------------
 // Codegen
 //-------------------------------------------------------------------------
 
+// Everything LLVM is created within 'context', which belongs to a single
+// compilation. Two of them can run at the same time in different threads.
 struct CodegenContext {
+	llvm::LLVMContext *context;
 	llvm::Module *module;
 	llvm::IRBuilder<> *builder;
-	Scope scope;
 	llvm::Function *F;
+
+	// by the indices from the binder
+	std::vector<llvm::Function*> funcs;
+	std::vector<llvm::Value*> slots; // current values of the variables
+	std::vector<unsigned> names; // of the slots, for the IR
+	const enum value_type *types; // of the slots, optional
+
+	// values of the shared (hash-consed) expressions emitted in 'cse_block',
+	// forgotten on a store or when the builder moves to another block
+	unordered_map<uintptr_t, llvm::Value*> cse; // by the view's key
+	llvm::BasicBlock *cse_block;
+	unsigned calls; // emitted so far, calls are not pure
+
+	bool fast; // the current function is a fast-math one
 };
 
-static llvm::Value *codegen_expr(CodegenContext *ctx, struct expr *e)
+static const llvm::Type *type_double(CodegenContext *ctx) { return llvm::Type::getDoubleTy(*ctx->context); }
+static llvm::Value *const_double(CodegenContext *ctx, double num) { return llvm::ConstantFP::get(type_double(ctx), num); }
+static const llvm::Type *type_int(CodegenContext *ctx) { return llvm::Type::getInt64Ty(*ctx->context); }
+static llvm::Value *const_int(CodegenContext *ctx, int64_t num) { return llvm::ConstantInt::get(type_int(ctx), num, true); }
+
+static const llvm::Type *type_of(CodegenContext *ctx, enum value_type t)
 {
-	switch (e->type) {
-	case EXPR_NUM:
+	return t == TYPE_INT ? type_int(ctx) : type_double(ctx);
+}
+
+//-------------------------------------------------------------------------
+// AST views. The code generator below walks either AST through a view:
+// TreeView reads the bound tree, FlatView the flat AST of flatten_bound.
+// Expressions and statements are node handles, a block is the handle of
+// its list of statements, an Iter goes over that list or the args of a
+// call. A missing optional child is a null handle, the flat node 0 is the
+// top block and never a child.
+//-------------------------------------------------------------------------
+
+struct TreeView {
+	typedef struct expr *Expr;
+	typedef struct stmt *Stmt;
+	typedef struct stmts *Block;
+	typedef size_t Iter;
+
+	struct binding *b;
+
+	explicit TreeView(struct binding *b): b(b) {}
+
+	enum expr_type etype(Expr e) const { return e->type; }
+	double num(Expr e) const { return e->num; }
+	int tok(Expr e) const { return e->bin.tok; }
+	Expr lhs(Expr e) const { return e->bin.lhs; }
+	Expr rhs(Expr e) const { return e->bin.rhs; }
+	bool wide(Expr e) const { return e->wide; }
+
+	// EXPR_IDENT: slot of a variable or a function, EXPR_CALL: the callee
+	bool local(Expr e) const { return e->ident.bind == BIND_LOCAL; }
+	unsigned index(Expr e) const { return e->ident.index; }
+	unsigned sym(Expr e) const { return e->ident.sym; }
+	unsigned callee(Expr e) const { return e->call.ident->ident.index; }
+	size_t nargs(Expr e) const { return e->call.args->v_n; }
+	Iter args(Expr e) const { return 0; }
+	bool args_end(Expr e, Iter it) const { return it == e->call.args->v_n; }
+	Expr arg(Expr e, Iter it) const { return e->call.args->v[it]; }
+
+	// a shared expression and the key of all its uses, see codegen_expr
+	bool shared(Expr e) const { return e->consed; }
+	uintptr_t key(Expr e) const { return (uintptr_t)e; }
+
+	enum stmt_type stype(Stmt s) const { return s->type; }
+	Expr expr(Stmt s) const { return s->expr; }
+	Block block(Stmt s) const { return s->block; }
+	Iter stmts(Block ss) const { return 0; }
+	bool stmts_end(Block ss, Iter it) const { return it == ss->v_n; }
+	Stmt stmt(Block ss, Iter it) const { return ss->v[it]; }
+	Iter next(Iter it) const { return it + 1; }
+
+	// STMT_ASSIGN and STMT_VAR, the value of these and STMT_RETURN
+	Expr target(Stmt s) const
 	{
-		return const_double(e->num);
+		return s->type == STMT_ASSIGN ? s->assign.ident : s->var.ident;
 	}
-	case EXPR_IDENT:
+	Expr value(Stmt s) const
+	{
+		switch (s->type) {
+		case STMT_ASSIGN: return s->assign.rhs;
+		case STMT_VAR: return s->var.init;
+		default: return s->ret;
+		}
+	}
+
+	// STMT_IFELSE and STMT_FOR, the body of these and STMT_FUNC
+	Expr cond(Stmt s) const
+	{
+		return s->type == STMT_IFELSE ? s->ifelse.cond : s->forloop.cond;
+	}
+	Block body(Stmt s) const
+	{
+		switch (s->type) {
+		case STMT_IFELSE: return s->ifelse.block->block;
+		case STMT_FOR: return s->forloop.block->block;
+		default: return s->func.block ? s->func.block->block : 0;
+		}
+	}
+	Block else_body(Stmt s) const
 	{
-		// if it's in a scope, then it is a variable
-		auto v = ctx->scope.get(to_string(e).c_str());
-		if (v)
-			return ctx->builder->CreateLoad(v, "loadtmp");
+		return s->ifelse.elseblock ? s->ifelse.elseblock->block : 0;
+	}
 
-		// try function otherwise
-		auto F = ctx->module->getFunction(to_ref(e));
-		if (!F)
-			return errorv("Cannot resolve entity: %s", to_string(e).c_str());
+	// STMT_FUNC
+	unsigned func(Stmt s) const { return s->func.ident->ident.index; }
+	size_t nparams(Stmt s) const { return s->func.args ? s->func.args->v_n : 0; }
+	unsigned param(Stmt s, size_t i) const { return s->func.args->v[i]->ident.sym; }
+	unsigned nslots(Stmt s) const { return s->func.nslots; }
+	const enum value_type *types(Stmt s) const { return s->func.types; }
+	bool fast(Stmt s) const { return s->func.fast; }
 
-		return ctx->builder->CreateCall(F, "calltmp");
+	// the binder's function table, types may be null
+	size_t nfuncs() const { return b->funcs_n; }
+	void signature(size_t k, unsigned *sym, size_t *nargs,
+		       const enum value_type **types, enum value_type *rettype) const
+	{
+		struct stmt *s = b->funcs[k];
+		*sym = s->func.ident->ident.sym;
+		*nargs = nparams(s);
+		*types = s->func.types;
+		*rettype = s->func.rettype;
 	}
-	case EXPR_BIN:
+};
+
+struct FlatView {
+	typedef unsigned Expr;
+	typedef unsigned Stmt;
+	typedef unsigned Block;
+	typedef unsigned Iter;
+
+	struct flat_ast *fa;
+
+	explicit FlatView(struct flat_ast *fa): fa(fa) {}
+
+	enum expr_type etype(Expr e) const
 	{
-		auto L = codegen_expr(ctx, e->bin.lhs);
-		auto R = codegen_expr(ctx, e->bin.rhs);
-		if (L == 0 || R == 0)
-			return errorv("Failed to codegen lhs or rhs for binaryop");
-
-		switch (e->bin.tok) {
-		case PLUS: return ctx->builder->CreateFAdd(L, R, "addtmp");
-		case MINUS: return ctx->builder->CreateFSub(L, R, "subtmp");
-		case TIMES: return ctx->builder->CreateFMul(L, R, "multmp");
-		case DIVIDE: return ctx->builder->CreateFDiv(L, R, "divtmp");
-		case LESS:
-			L = ctx->builder->CreateFCmpULT(L, R, "cmptmp");
-			return ctx->builder->CreateUIToFP(L, type_double(), "casttmp");
+		switch (fa->kind[e]) {
+		case FLAT_NUM: return EXPR_NUM;
+		case FLAT_BIN: return EXPR_BIN;
+		case FLAT_CALL: return EXPR_CALL;
+		default: return EXPR_IDENT;
 		}
 	}
-	case EXPR_CALL:
+	double num(Expr e) const { return fa->nums[fa->data[e]]; }
+	int tok(Expr e) const { return fa->data[e]; }
+	Expr lhs(Expr e) const { return e+1; }
+	Expr rhs(Expr e) const { return fa->next[e+1]; }
+	bool wide(Expr e) const { return fa->bound[e] & FLAT_BOUND_WIDE; }
+
+	bool local(Expr e) const { return !(fa->bound[e] & FLAT_BOUND_FUNC); }
+	unsigned index(Expr e) const { return fa->bound[e] & FLAT_BOUND_INDEX; }
+	unsigned sym(Expr e) const { return fa->data[e]; }
+	unsigned callee(Expr e) const { return index(e); }
+	size_t nargs(Expr e) const
 	{
-		auto F = ctx->module->getFunction(to_ref(e->call.ident));
-		if (!F)
-			return errorv("Cannot resolve function: %s", to_string(e).c_str());
+		size_t n = 0;
+		for (Iter it = args(e); !args_end(e, it); it = next(it))
+			n++;
+		return n;
+	}
+	Iter args(Expr e) const { return e+1; }
+	bool args_end(Expr e, Iter it) const { return it >= fa->next[e]; }
+	Expr arg(Expr e, Iter it) const { return it; }
 
-		int numargs = F->arg_size();
-		if (e->call.args->v_n != numargs)
-			return errorv("Invalid number of arguments for a function call: %s", to_string(e).c_str());
+	// copies of a shared node have the index of the first one
+	bool shared(Expr e) const { return fa->bound[e] & FLAT_BOUND_SHARED; }
+	uintptr_t key(Expr e) const { return fa->bound[e] & FLAT_BOUND_INDEX; }
 
-		std::vector<llvm::Value*> args;
-		args.resize(numargs);
-		for (int i = 0; i < numargs; i++)
-			args[i] = codegen_expr(ctx, e->call.args->v[i]);
+	enum stmt_type stype(Stmt s) const
+	{
+		switch (fa->kind[s]) {
+		case FLAT_ASSIGN: return STMT_ASSIGN;
+		case FLAT_BLOCK: return STMT_BLOCK;
+		case FLAT_IFELSE: return STMT_IFELSE;
+		case FLAT_FOR: return STMT_FOR;
+		case FLAT_FUNC: return STMT_FUNC;
+		case FLAT_VAR: return STMT_VAR;
+		case FLAT_RETURN: return STMT_RETURN;
+		default: return STMT_EXPR;
+		}
+	}
+	Expr expr(Stmt s) const { return s; }
+	Block block(Stmt s) const { return s; }
+	Iter stmts(Block ss) const { return ss+1; }
+	bool stmts_end(Block ss, Iter it) const { return it >= fa->next[ss]; }
+	Stmt stmt(Block ss, Iter it) const { return it; }
+	Iter next(Iter it) const { return fa->next[it]; }
+
+	Expr target(Stmt s) const { return s+1; }
+	Expr value(Stmt s) const
+	{
+		unsigned v = fa->kind[s] == FLAT_RETURN ? s+1 : fa->next[s+1];
+		return v < fa->next[s] ? v : 0;
+	}
+
+	Expr cond(Stmt s) const { return s+1; }
+	Block body(Stmt s) const
+	{
+		if (fa->kind[s] != FLAT_FUNC)
+			return fa->next[s+1];
+		return flat_func_has_body(fa, s) ? s+2+flat_func_nargs(fa, s) : 0;
+	}
+	Block else_body(Stmt s) const
+	{
+		unsigned b = fa->next[body(s)];
+		return b < fa->next[s] ? b : 0;
+	}
 
-		return ctx->builder->CreateCall(F, args.begin(), args.end(), "calltmp");
+	unsigned func(Stmt s) const { return index(s+1); }
+	size_t nparams(Stmt s) const { return flat_func_nargs(fa, s); }
+	unsigned param(Stmt s, size_t i) const { return fa->data[s+2+i]; }
+	unsigned nslots(Stmt s) const { return fa->funcs[func(s)].nslots; }
+	const enum value_type *types(Stmt s) const { return fa->types + fa->funcs[func(s)].types; }
+	bool fast(Stmt s) const { return fa->data[s] & FLAT_FAST; }
+
+	size_t nfuncs() const { return fa->funcs_n; }
+	void signature(size_t k, unsigned *sym, size_t *nargs,
+		       const enum value_type **types, enum value_type *rettype) const
+	{
+		struct flat_func *f = &fa->funcs[k];
+		*sym = f->sym;
+		*nargs = f->nargs;
+		*types = fa->types + f->types;
+		*rettype = f->rettype;
+	}
+};
+
+template <class V>
+static llvm::Value *codegen_bound_ident(CodegenContext *ctx, const V &v, typename V::Expr e)
+{
+	if (v.local(e))
+		return ctx->slots[v.index(e)];
+
+	ctx->calls++;
+	return ctx->builder->CreateCall(ctx->funcs[v.index(e)], "calltmp");
+}
+
+// integers (see types.c) turn into doubles where the two meet
+static llvm::Value *codegen_convert(CodegenContext *ctx, llvm::Value *v, const llvm::Type *type)
+{
+	if (v == 0 || v->getType() == type)
+		return v;
+	if (type == type_double(ctx))
+		return ctx->builder->CreateSIToFP(v, type, "convtmp");
+	return ctx->builder->CreateFPToSI(v, type, "convtmp");
+}
+
+// value != 0, as an i1
+static llvm::Value *codegen_truth(CodegenContext *ctx, llvm::Value *v, const char *name)
+{
+	// a comparison used as a value before (shared expression)
+	auto zext = llvm::dyn_cast<llvm::ZExtInst>(v);
+	if (zext && zext->getOperand(0)->getType() == llvm::Type::getInt1Ty(*ctx->context))
+		return zext->getOperand(0);
+
+	if (v->getType() == type_int(ctx))
+		return ctx->builder->CreateICmpNE(v, const_int(ctx, 0), name);
+	return ctx->builder->CreateFCmpONE(v, const_double(ctx, 0), name);
+}
+
+// L < R, as an i1
+static llvm::Value *codegen_less(CodegenContext *ctx, llvm::Value *L, llvm::Value *R,
+				 const char *name)
+{
+	if (L->getType() == type_int(ctx) && R->getType() == type_int(ctx))
+		return ctx->builder->CreateICmpSLT(L, R, name);
+	L = codegen_convert(ctx, L, type_double(ctx));
+	R = codegen_convert(ctx, R, type_double(ctx));
+	return ctx->builder->CreateFCmpULT(L, R, name);
+}
+
+// 1/c for x/c as x * 1/c, or 0. The product is the same if c is a power of
+// two, any other c needs fast-math.
+static llvm::Value *codegen_reciprocal(CodegenContext *ctx, llvm::Value *R)
+{
+	auto C = llvm::dyn_cast<llvm::ConstantFP>(R);
+	if (C == 0)
+		return 0;
+	double c = C->getValueAPF().convertToDouble();
+	double r = 1 / c;
+	int exp;
+	if (!(fabs(r) >= DBL_MIN && fabs(r) <= DBL_MAX))
+		return 0;
+	if (!ctx->fast && fabs(frexp(c, &exp)) != 0.5)
+		return 0;
+	return const_double(ctx, r);
+}
+
+// (x op c1) op c2 as x op (c1 op c2), fast-math only
+static llvm::Value *codegen_fast_fold(CodegenContext *ctx, llvm::Instruction::BinaryOps op,
+				      llvm::Value *L, llvm::Value *R, const char *name)
+{
+	auto B = llvm::dyn_cast<llvm::BinaryOperator>(L);
+	if (!ctx->fast || !llvm::isa<llvm::ConstantFP>(R) || B == 0 ||
+	    B->getOpcode() != op || !llvm::isa<llvm::ConstantFP>(B->getOperand(1)))
+		return 0;
+	auto C = ctx->builder->CreateBinOp(op, B->getOperand(1), R);
+	return ctx->builder->CreateBinOp(op, B->getOperand(0), C, name);
+}
+
+// 'wide' is set if integer operands may give an inexact result, see
+// infer_types
+static llvm::Value *codegen_binop(CodegenContext *ctx, int tok, llvm::Value *L, llvm::Value *R,
+				  bool wide)
+{
+	llvm::Value *v;
+
+	if (L == 0 || R == 0)
+		return errorv("Failed to codegen lhs or rhs for binaryop");
+
+	// division is always done in doubles
+	bool isint = tok != DIVIDE && !wide && L->getType() == type_int(ctx) && R->getType() == type_int(ctx);
+	if (!isint) {
+		L = codegen_convert(ctx, L, type_double(ctx));
+		R = codegen_convert(ctx, R, type_double(ctx));
+	}
+
+	switch (tok) {
+	case PLUS:
+		if (isint)
+			return ctx->builder->CreateAdd(L, R, "addtmp");
+		if ((v = codegen_fast_fold(ctx, llvm::Instruction::FAdd, L, R, "addtmp")))
+			return v;
+		return ctx->builder->CreateFAdd(L, R, "addtmp");
+	case MINUS:
+		if (isint)
+			return ctx->builder->CreateSub(L, R, "subtmp");
+		return ctx->builder->CreateFSub(L, R, "subtmp");
+	case TIMES:
+		if (isint)
+			return ctx->builder->CreateMul(L, R, "multmp");
+		if ((v = codegen_fast_fold(ctx, llvm::Instruction::FMul, L, R, "multmp")))
+			return v;
+		return ctx->builder->CreateFMul(L, R, "multmp");
+	case DIVIDE:
+		if ((v = codegen_reciprocal(ctx, R)))
+			return codegen_binop(ctx, TIMES, L, v, true);
+		return ctx->builder->CreateFDiv(L, R, "divtmp");
+	case LESS:
+		// only a comparison used as a value is widened, see codegen_cond
+		L = codegen_less(ctx, L, R, "cmptmp");
+		return ctx->builder->CreateZExt(L, type_int(ctx), "casttmp");
+	}
+	return errorv("Unknown binary operator");
+}
+
+// arguments are converted to the types of the parameters
+static llvm::Value *codegen_call(CodegenContext *ctx, llvm::Function *F,
+				 std::vector<llvm::Value*> &args)
+{
+	auto FT = F->getFunctionType();
+	for (size_t i = 0; i < args.size(); i++)
+		args[i] = codegen_convert(ctx, args[i], FT->getParamType(i));
+
+	ctx->calls++;
+	return ctx->builder->CreateCall(F, args.begin(), args.end(), "calltmp");
+}
+
+template <class V>
+static llvm::Value *codegen_expr(CodegenContext *ctx, const V &v, typename V::Expr e);
+
+template <class V>
+static llvm::Value *codegen_expr_uncached(CodegenContext *ctx, const V &v, typename V::Expr e)
+{
+	switch (v.etype(e)) {
+	case EXPR_NUM:
+		if (num_is_int(v.num(e)))
+			return const_int(ctx, (int64_t)v.num(e));
+		return const_double(ctx, v.num(e));
+	case EXPR_IDENT:
+		return codegen_bound_ident(ctx, v, e);
+	case EXPR_BIN:
+	{
+		auto L = codegen_expr(ctx, v, v.lhs(e));
+		auto R = codegen_expr(ctx, v, v.rhs(e));
+		return codegen_binop(ctx, v.tok(e), L, R, v.wide(e));
+	}
+	case EXPR_CALL:
+	{
+		auto F = ctx->funcs[v.callee(e)];
+		std::vector<llvm::Value*> args;
+		args.reserve(v.nargs(e));
+		for (auto it = v.args(e); !v.args_end(e, it); it = v.next(it))
+			args.push_back(codegen_expr(ctx, v, v.arg(e, it)));
+		return codegen_call(ctx, F, args);
 	}
 	default:
 		return errorv("Unknown expression type");
 	}
 }
 
-static llvm::Value *codegen_entry_alloca(llvm::Function *F, llvm::StringRef name)
+static void forget_cse(CodegenContext *ctx)
+{
+	ctx->cse.clear();
+	ctx->cse_block = 0;
+}
+
+// A shared subtree is emitted once per basic block, unless it turned out to
+// call a function (an identifier may name one).
+template <class V>
+static llvm::Value *codegen_expr(CodegenContext *ctx, const V &v, typename V::Expr e)
+{
+	if (!v.shared(e) || v.etype(e) == EXPR_NUM)
+		return codegen_expr_uncached(ctx, v, e);
+
+	auto bb = ctx->builder->GetInsertBlock();
+	if (ctx->cse_block != bb) {
+		ctx->cse.clear();
+		ctx->cse_block = bb;
+	} else {
+		auto it = ctx->cse.find(v.key(e));
+		if (it != ctx->cse.end())
+			return it->second;
+	}
+
+	unsigned calls = ctx->calls;
+	auto val = codegen_expr_uncached(ctx, v, e);
+	if (val && ctx->calls == calls)
+		ctx->cse[v.key(e)] = val;
+	return val;
+}
+
+// Condition of a branch, as an i1. A comparison is branched on directly,
+// without turning it into a number and comparing that against zero.
+template <class V>
+static llvm::Value *codegen_cond(CodegenContext *ctx, const V &v, typename V::Expr e,
+				 const char *name)
 {
-	llvm::IRBuilder<> builder(&F->getEntryBlock(), F->getEntryBlock().begin());
-	return builder.CreateAlloca(type_double(), 0, name);
+	if (v.etype(e) == EXPR_BIN && v.tok(e) == LESS) {
+		auto L = codegen_expr(ctx, v, v.lhs(e));
+		auto R = codegen_expr(ctx, v, v.rhs(e));
+		if (L == 0 || R == 0)
+			return 0;
+		return codegen_less(ctx, L, R, name);
+	}
+
+	auto val = codegen_expr(ctx, v, e);
+	return val ? codegen_truth(ctx, val, name) : 0;
 }
 
-static int codegen_statements(CodegenContext *ctx, struct stmts *ss);
+template <class V>
+static int codegen_statements(CodegenContext *ctx, const V &v, typename V::Block ss);
 
-static void codegen_func(CodegenContext *ctx, struct stmt *s)
+// a function may be declared before (foreign declaration), it's reused then
+// main is renamed, the runtime has a main of its own
+static llvm::StringRef func_name(unsigned sym)
 {
-	int numargs = s->func.args ? s->func.args->v_n : 0;
+	auto name = sym_ref(sym);
+	return name == "main" ? "_anc_main" : name;
+}
 
-	auto name = to_string(s->func.ident);
-	if (name == "main")
-		name = "_anc_main";
+static llvm::Function *codegen_proto(CodegenContext *ctx, unsigned sym,
+				     const std::vector<const llvm::Type*> &types,
+				     const llvm::Type *rettype)
+{
+	auto name = func_name(sym);
+	auto F = ctx->module->getFunction(name);
+	if (F)
+		return F;
 
-	std::vector<const llvm::Type*> types(numargs, type_double());
-	auto FT = llvm::FunctionType::get(type_double(), types, false);
-	auto F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, ctx->module);
-	if (s->func.block == 0)
-		return;
+	auto FT = llvm::FunctionType::get(rettype, types, false);
+	return llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, ctx->module);
+}
+
+// the arguments are the first slots of 'types', all doubles without it
+static llvm::Function *codegen_func_proto(CodegenContext *ctx, unsigned sym, size_t numargs,
+					  const enum value_type *types, enum value_type rettype)
+{
+	std::vector<const llvm::Type*> argtypes(numargs, type_double(ctx));
+	for (size_t i = 0; types && i < numargs; i++)
+		argtypes[i] = type_of(ctx, types[i]);
+	return codegen_proto(ctx, sym, argtypes, type_of(ctx, rettype));
+}
+
+// converts 'v' to the return type, no value means zero
+static void codegen_ret(CodegenContext *ctx, llvm::Value *v)
+{
+	auto type = ctx->F->getReturnType();
+	ctx->builder->CreateRet(v ? codegen_convert(ctx, v, type) : const_zero(type));
+}
 
-	auto entry = llvm::BasicBlock::Create(llvm::getGlobalContext(), "entry", F);
-	llvm::IRBuilder<> builder(llvm::getGlobalContext());
+// Creates the entry block of F and names the arguments after 'params', the
+// arguments go to the beginning of 'slots'. 'builder' is left pointing to
+// the entry block.
+static void codegen_params(llvm::Function *F, llvm::IRBuilder<> &builder,
+			   const std::vector<unsigned> &params, std::vector<llvm::Value*> &slots)
+{
+	auto entry = llvm::BasicBlock::Create(F->getContext(), "entry", F);
 	builder.SetInsertPoint(entry);
 
 	int i = 0;
 	for (auto it = F->arg_begin(); it != F->arg_end(); it++, i++) {
-		auto name = to_string(s->func.args->v[i]);
-		it->setName(name);
-		if (ctx->scope.get(name.c_str())) {
-			errorv("Redeclaration of a variable: %s\n", name.c_str());
-		} else {
-			auto store = codegen_entry_alloca(F, name);
-			builder.CreateStore(it, store);
-			ctx->scope.add(name.c_str(), store);
-		}
+		it->setName(sym_name(params[i]));
+		slots[i] = it;
 	}
+}
+
+template <class V>
+static void codegen_func(CodegenContext *ctx, const V &v, typename V::Stmt s)
+{
+	auto F = ctx->funcs[v.func(s)];
+	auto body = v.body(s);
+	if (!body)
+		return;
+
+	size_t numargs = v.nparams(s);
+	std::vector<unsigned> params(numargs);
+	for (size_t i = 0; i < numargs; i++)
+		params[i] = v.param(s, i);
+
+	llvm::IRBuilder<> builder(*ctx->context);
+	ctx->slots.assign(v.nslots(s), 0);
+	ctx->names.assign(params.begin(), params.end());
+	ctx->names.resize(v.nslots(s));
+	ctx->types = v.types(s);
+	ctx->fast = v.fast(s);
+	codegen_params(F, builder, params, ctx->slots);
 
 	auto savebuilder = ctx->builder;
 	ctx->builder = &builder;
 	ctx->F = F;
 
-	int terminated = codegen_statements(ctx, s->func.block->block);
+	int terminated = codegen_statements(ctx, v, body);
 	if (!terminated)
-		ctx->builder->CreateRet(const_double(0));
+		codegen_ret(ctx, 0);
 
 	ctx->builder = savebuilder;
 	ctx->F = 0;
+	ctx->types = 0;
+	ctx->fast = false;
 }
 
-static void codegen_var(CodegenContext *ctx, struct stmt *s)
+static void codegen_set(CodegenContext *ctx, unsigned slot, llvm::Value *v)
 {
-	auto ref = to_ref(s->var.ident);
-	auto str = to_string(s->var.ident);
-	if (ctx->scope.get(str.c_str())) {
-		errorv("Redeclaration of a variable: %s\n", str.c_str());
-	} else {
-		auto store = ctx->builder->CreateAlloca(type_double(), 0, ref);
-		if (s->var.init) {
-			auto init = codegen_expr(ctx, s->var.init);
-			ctx->builder->CreateStore(init, store);
-		} else
-			ctx->builder->CreateStore(const_double(0), store);
+	auto type = ctx->types ? type_of(ctx, ctx->types[slot]) : type_double(ctx);
+	ctx->slots[slot] = v ? codegen_convert(ctx, v, type) : const_zero(type);
+	forget_cse(ctx);
+}
+
+template <class V>
+static void codegen_var(CodegenContext *ctx, const V &v, typename V::Stmt s)
+{
+	llvm::Value *init = 0;
+	if (v.value(s))
+		init = codegen_expr(ctx, v, v.value(s));
+
+	auto ident = v.target(s);
+	ctx->names[v.index(ident)] = v.sym(ident);
+	codegen_set(ctx, v.index(ident), init);
+}
 
-		ctx->scope.add(str.c_str(), store);
+template <class V>
+static void codegen_assign(CodegenContext *ctx, const V &v, typename V::Stmt s)
+{
+	auto rhs = codegen_expr(ctx, v, v.value(s));
+	if (!rhs) {
+		errorv("Can't evaluate rhs expr in an assign stmt");
+		return;
 	}
+	codegen_set(ctx, v.index(v.target(s)), rhs);
 }
 
-static void codegen_assign(CodegenContext *ctx, struct stmt *s)
+//-------------------------------------------------------------------------
+// SSA construction. A variable has no stack slot, 'slots' tracks its value
+// as the statements are walked. The structured control flow tells where
+// values meet: at the end of an if and at the head of a loop, these get a
+// phi. A variable declared inside a branch or a loop body is out of scope
+// there, its slot is null.
+//-------------------------------------------------------------------------
+
+typedef std::vector<llvm::Value*> Values;
+
+static llvm::PHINode *codegen_phi(CodegenContext *ctx, llvm::BasicBlock *bb,
+				  unsigned slot, const llvm::Type *type)
 {
-	auto ref = to_ref(s->assign.ident);
-	auto str = to_string(s->assign.ident);
-	auto store = ctx->scope.get(str.c_str());
-	if (!store) {
-		errorv("Cannot resolve variable: %s\n", str.c_str());
-	} else {
-		auto rhs = codegen_expr(ctx, s->assign.rhs);
-		if (!rhs) {
-			errorv("Can't evaluate rhs expr in an assign stmt");
-			return;
+	return llvm::PHINode::Create(type, sym_name(ctx->names[slot]), bb);
+}
+
+// joins the values of 'slots' coming from 'a' with 'bvals' coming from 'b'
+// in 'bb', which has no instructions yet
+static void codegen_join(CodegenContext *ctx, llvm::BasicBlock *bb,
+			 llvm::BasicBlock *a, llvm::BasicBlock *b, const Values &bvals)
+{
+	for (size_t i = 0; i < ctx->slots.size(); i++) {
+		auto v = ctx->slots[i];
+		if (v == bvals[i])
+			continue;
+		if (v == 0 || bvals[i] == 0) {
+			ctx->slots[i] = 0;
+			continue;
+		}
+
+		auto phi = codegen_phi(ctx, bb, i, v->getType());
+		phi->addIncoming(v, a);
+		phi->addIncoming(bvals[i], b);
+		ctx->slots[i] = phi;
+	}
+}
+
+// marks the variables assigned in 'ss', these need a phi at a loop head
+template <class V>
+static void find_assigned(const V &v, typename V::Block ss, std::vector<bool> &assigned)
+{
+	for (auto it = v.stmts(ss); !v.stmts_end(ss, it); it = v.next(it)) {
+		auto s = v.stmt(ss, it);
+		switch (v.stype(s)) {
+		case STMT_ASSIGN:
+			assigned[v.index(v.target(s))] = true;
+			break;
+		case STMT_BLOCK:
+			find_assigned(v, v.block(s), assigned);
+			break;
+		case STMT_IFELSE:
+			find_assigned(v, v.body(s), assigned);
+			if (v.else_body(s))
+				find_assigned(v, v.else_body(s), assigned);
+			break;
+		case STMT_FOR:
+			find_assigned(v, v.body(s), assigned);
+			break;
+		default:
+			break;
 		}
-		ctx->builder->CreateStore(rhs, store);
 	}
 }
 
-static void codegen_ifelse(CodegenContext *ctx, struct stmt *s)
+template <class V>
+static void codegen_ifelse(CodegenContext *ctx, const V &v, typename V::Stmt s)
 {
-	auto cond = codegen_expr(ctx, s->ifelse.cond);
-	if (!cond) {
+	auto ifcond = codegen_cond(ctx, v, v.cond(s), "ifcond");
+	if (!ifcond) {
 		errorv("Can't evaluate condition inside if statement");
 		return;
 	}
 
-	auto iftrue = llvm::BasicBlock::Create(llvm::getGlobalContext(), "iftrue", ctx->F);
+	auto elseblock = v.else_body(s);
+	auto iftrue = llvm::BasicBlock::Create(*ctx->context, "iftrue", ctx->F);
 	llvm::BasicBlock *iffalse = 0;
-	if (s->ifelse.elseblock)
-		iffalse = llvm::BasicBlock::Create(llvm::getGlobalContext(), "iffalse", ctx->F);
-	auto end = llvm::BasicBlock::Create(llvm::getGlobalContext(), "ifend", ctx->F);
+	if (elseblock)
+		iffalse = llvm::BasicBlock::Create(*ctx->context, "iffalse", ctx->F);
+	auto end = llvm::BasicBlock::Create(*ctx->context, "ifend", ctx->F);
 
-	auto ifcond = ctx->builder->CreateFCmpONE(cond, const_double(0), "ifcond");
-	ctx->builder->CreateCondBr(ifcond, iftrue, iffalse);
+	ctx->builder->CreateCondBr(ifcond, iftrue, iffalse ? iffalse : end);
+	auto falsefrom = ctx->builder->GetInsertBlock();
+	Values before = ctx->slots;
 
 	// true
 	ctx->builder->SetInsertPoint(iftrue);
-	int terminated = codegen_statements(ctx, s->ifelse.block->block);
-	if (!terminated)
+	int trueterm = codegen_statements(ctx, v, v.body(s));
+	if (!trueterm)
 		ctx->builder->CreateBr(end);
+	auto truefrom = ctx->builder->GetInsertBlock();
+	Values truevals;
+	truevals.swap(ctx->slots);
+	ctx->slots = before;
 
 	// false
-	if (s->ifelse.elseblock) {
+	int falseterm = 0;
+	if (elseblock) {
 		ctx->builder->SetInsertPoint(iffalse);
-		int terminated = codegen_statements(ctx, s->ifelse.elseblock->block);
-		if (!terminated)
+		falseterm = codegen_statements(ctx, v, elseblock);
+		if (!falseterm)
 			ctx->builder->CreateBr(end);
+		falsefrom = ctx->builder->GetInsertBlock();
 	}
 
+	// 'end' is unreachable if both branches return, the values from before
+	// the if are as good as any there
 	ctx->builder->SetInsertPoint(end);
+	if (trueterm && falseterm)
+		ctx->slots.swap(before);
+	else if (falseterm)
+		ctx->slots.swap(truevals);
+	else if (!trueterm)
+		codegen_join(ctx, end, falsefrom, truefrom, truevals);
 }
 
-static void codegen_return(CodegenContext *ctx, struct stmt *s)
+template <class V>
+static void codegen_return(CodegenContext *ctx, const V &v, typename V::Stmt s)
 {
-	if (s->ret) {
-		auto v = codegen_expr(ctx, s->ret);
-		ctx->builder->CreateRet(v);
-	} else
-		ctx->builder->CreateRet(const_double(0));
+	if (v.value(s))
+		codegen_ret(ctx, codegen_expr(ctx, v, v.value(s)));
+	else
+		codegen_ret(ctx, 0);
 }
 
-static void codegen_forloop(CodegenContext *ctx, struct stmt *s)
+template <class V>
+static void codegen_forloop(CodegenContext *ctx, const V &v, typename V::Stmt s)
 {
-	auto loopdecide = llvm::BasicBlock::Create(llvm::getGlobalContext(), "loopdecide", ctx->F);
-	auto loop = llvm::BasicBlock::Create(llvm::getGlobalContext(), "loop", ctx->F);
-	auto end = llvm::BasicBlock::Create(llvm::getGlobalContext(), "endloop", ctx->F);
+	auto loopdecide = llvm::BasicBlock::Create(*ctx->context, "loopdecide", ctx->F);
+	auto loop = llvm::BasicBlock::Create(*ctx->context, "loop", ctx->F);
+	auto end = llvm::BasicBlock::Create(*ctx->context, "endloop", ctx->F);
 
+	auto entry = ctx->builder->GetInsertBlock();
 	ctx->builder->CreateBr(loopdecide);
 
-	// loopdecide
+	// loopdecide, the variables assigned in the loop get a phi
+	std::vector<bool> assigned(ctx->slots.size());
+	find_assigned(v, v.body(s), assigned);
+
+	std::vector<std::pair<unsigned, llvm::PHINode*> > phis;
+	for (unsigned i = 0; i < ctx->slots.size(); i++) {
+		auto val = ctx->slots[i];
+		if (!assigned[i] || val == 0)
+			continue;
+		auto phi = codegen_phi(ctx, loopdecide, i, val->getType());
+		phi->addIncoming(val, entry);
+		ctx->slots[i] = phi;
+		phis.push_back(std::make_pair(i, phi));
+	}
+
 	ctx->builder->SetInsertPoint(loopdecide);
-	auto cond = codegen_expr(ctx, s->forloop.cond);
-	if (!cond) {
+	auto loopcond = codegen_cond(ctx, v, v.cond(s), "loopcond");
+	if (!loopcond) {
 		errorv("Cannot evaluate condition inside for statement");
 		return;
 	}
 
-	auto loopcond = ctx->builder->CreateFCmpONE(cond, const_double(0), "loopcond");
 	ctx->builder->CreateCondBr(loopcond, loop, end);
+	Values head = ctx->slots;
 
 	// loop
 	ctx->builder->SetInsertPoint(loop);
-	int terminated = codegen_statements(ctx, s->forloop.block->block);
-	if (!terminated)
+	int terminated = codegen_statements(ctx, v, v.body(s));
+	if (!terminated) {
+		auto from = ctx->builder->GetInsertBlock();
+		for (size_t i = 0; i < phis.size(); i++)
+			phis[i].second->addIncoming(ctx->slots[phis[i].first], from);
 		ctx->builder->CreateBr(loopdecide);
+	}
 
-	// end
+	// end, the loop is left from its head
 	ctx->builder->SetInsertPoint(end);
+	ctx->slots.swap(head);
 }
 
-static int codegen_statements(CodegenContext *ctx, struct stmts *ss)
+template <class V>
+static int codegen_statements(CodegenContext *ctx, const V &v, typename V::Block ss)
 {
-	for (int i = 0; i < ss->v_n; i++) {
-		struct stmt *s = ss->v[i];
-		switch (s->type) {
+	for (auto it = v.stmts(ss); !v.stmts_end(ss, it); it = v.next(it)) {
+		auto s = v.stmt(ss, it);
+		switch (v.stype(s)) {
 		case STMT_EXPR:
-			codegen_expr(ctx, s->expr);
+			codegen_expr(ctx, v, v.expr(s));
+			break;
+		case STMT_BLOCK:
+			if (codegen_statements(ctx, v, v.block(s)))
+				return 1;
 			break;
 		case STMT_FUNC:
-			ctx->scope.values.clear();
-			codegen_func(ctx, s);
+			codegen_func(ctx, v, s);
 			break;
 		case STMT_RETURN:
-			codegen_return(ctx, s);
+			codegen_return(ctx, v, s);
 			return 1; // terminated
 			break;
 		case STMT_VAR:
-			codegen_var(ctx, s);
+			codegen_var(ctx, v, s);
 			break;
 		case STMT_ASSIGN:
-			codegen_assign(ctx, s);
+			codegen_assign(ctx, v, s);
 			break;
 		case STMT_IFELSE:
-			codegen_ifelse(ctx, s);
+			codegen_ifelse(ctx, v, s);
 			break;
 		case STMT_FOR:
-			codegen_forloop(ctx, s);
+			codegen_forloop(ctx, v, s);
 			break;
 		}
 	}
 	return 0;
 }
 
-extern "C" LLVMModuleRef codegen(struct stmts *stmts)
+// Starts a new module. All functions of the binder are declared upfront,
+// calls may go forward or to a function defined in another module (see
+// codegen_part).
+template <class V>
+static void codegen_module(CodegenContext *ctx, llvm::IRBuilder<> *builder, const V &v)
+{
+	ctx->module = new llvm::Module("main", *ctx->context);
+	ctx->builder = builder;
+	ctx->F = 0;
+	ctx->cse_block = 0;
+	ctx->calls = 0;
+	ctx->types = 0;
+	ctx->fast = false;
+
+	ctx->funcs.resize(v.nfuncs());
+	for (size_t i = 0; i < v.nfuncs(); i++) {
+		unsigned sym;
+		size_t numargs;
+		const enum value_type *types;
+		enum value_type rettype;
+		v.signature(i, &sym, &numargs, &types, &rettype);
+		ctx->funcs[i] = codegen_func_proto(ctx, sym, numargs, types, rettype);
+	}
+}
+
+extern "C" LLVMModuleRef codegen(LLVMContextRef context, struct stmts *stmts, struct binding *b)
+{
+	CodegenContext ctx;
+	ctx.context = llvm::unwrap(context);
+	llvm::IRBuilder<> builder(*ctx.context);
+	TreeView v(b);
+	codegen_module(&ctx, &builder, v);
+	codegen_statements(&ctx, v, stmts);
+	return wrap(ctx.module);
+}
+
+// A module with the bodies of the functions 'funcs' (indices into the
+// function table of 'b') and declarations of the rest. The AST and 'b' are
+// only read, several threads may generate parts of one program at once,
+// each into a context of its own.
+extern "C" LLVMModuleRef codegen_part(LLVMContextRef context, struct binding *b,
+				      const unsigned *funcs, size_t nfuncs)
 {
 	CodegenContext ctx;
-	llvm::IRBuilder<> builder(llvm::getGlobalContext());
-	ctx.module = new llvm::Module("main", llvm::getGlobalContext());
-	ctx.builder = &builder;
-	ctx.F = 0;
+	ctx.context = llvm::unwrap(context);
+	llvm::IRBuilder<> builder(*ctx.context);
+	TreeView v(b);
+	codegen_module(&ctx, &builder, v);
+	for (size_t i = 0; i < nfuncs; i++)
+		codegen_func(&ctx, v, b->funcs[funcs[i]]);
+	return wrap(ctx.module);
+}
+
+// The same code from the arrays of a flat AST, which carries the binding
+// and the types of the tree it was flattened from.
+extern "C" LLVMModuleRef codegen_flat(LLVMContextRef context, struct flat_ast *fa)
+{
+	if (!fa->bound) {
+		errorv("The flat AST is not bound, see flatten_bound");
+		return 0;
+	}
 
-	codegen_statements(&ctx, stmts);
+	CodegenContext ctx;
+	ctx.context = llvm::unwrap(context);
+	llvm::IRBuilder<> builder(*ctx.context);
+	FlatView v(fa);
+	codegen_module(&ctx, &builder, v);
+	codegen_statements(&ctx, v, 0u);
 	return wrap(ctx.module);
 }
+
+// LLVM's own global state has to be made thread-safe before two compilations
+// may run at the same time, returns 0 if LLVM was built without threads
+extern "C" int codegen_start_threads(void)
+{
+	return llvm::llvm_start_multithreaded();
+}
+
+//-------------------------------------------------------------------------
+// Target, the host machine with a given CPU
+//-------------------------------------------------------------------------
+
+static const llvm::Target *host_target;
+static std::string host_target_error;
+
+// Registers the assembly printer, which LLVMInitializeNativeTarget leaves
+// out, and looks up the host's target. Called once before any threads.
+extern "C" void codegen_init_target(void)
+{
+	llvm::InitializeNativeTargetAsmPrinter();
+	host_target = llvm::TargetRegistry::lookupTarget(llvm::sys::getHostTriple(),
+							 host_target_error);
+}
+
+// 'cpu' is a name as llc -mcpu takes it, or "native" for the host's own.
+// The CPU implies the instruction set extensions (SSE, AVX...) to use.
+static llvm::TargetMachine *create_target_machine(const char *cpu)
+{
+	if (host_target == 0) {
+		errorv("%s", host_target_error.c_str());
+		return 0;
+	}
+
+	std::string triple = llvm::sys::getHostTriple();
+	llvm::SubtargetFeatures features;
+	features.setCPU(strcmp(cpu, "native") == 0 ? llvm::sys::getHostCPUName() : cpu);
+	return host_target->createTargetMachine(triple, features.getString());
+}
+
+// Sets the triple and the data layout of the module, the passes optimize
+// for 'cpu' then. Returns 0 if the host has no target.
+extern "C" int codegen_target(LLVMModuleRef module, const char *cpu)
+{
+	auto TM = create_target_machine(cpu);
+	if (TM == 0)
+		return 0;
+	auto M = llvm::unwrap(module);
+	M->setTargetTriple(llvm::sys::getHostTriple());
+	M->setDataLayout(TM->getTargetData()->getStringRepresentation());
+	delete TM;
+	return 1;
+}
+
+static int codegen_emit_file(llvm::TargetMachine *TM, llvm::Module *M, const char *path)
+{
+	std::string error;
+	llvm::raw_fd_ostream out(path, error);
+	if (!error.empty()) {
+		errorv("%s: %s", path, error.c_str());
+		return 0;
+	}
+
+	llvm::formatted_raw_ostream fout(out);
+	llvm::PassManager pm;
+	pm.add(new llvm::TargetData(*TM->getTargetData()));
+	if (TM->addPassesToEmitFile(pm, fout, llvm::TargetMachine::CGFT_AssemblyFile,
+				    llvm::CodeGenOpt::Default)) {
+		errorv("%s: the target can't emit assembly", path);
+		return 0;
+	}
+	pm.run(*M);
+	return 1;
+}
+
+// Writes the assembly of the module for 'cpu' to 'path', what llc would
+// do with -mcpu. Returns 0 on failure.
+extern "C" int codegen_emit(LLVMModuleRef module, const char *cpu, const char *path)
+{
+	auto TM = create_target_machine(cpu);
+	if (TM == 0)
+		return 0;
+	int ok = codegen_emit_file(TM, llvm::unwrap(module), path);
+	delete TM;
+	return ok;
+}
+
+//-------------------------------------------------------------------------
+// Multiversioning. The program is compiled once for every CPU, clone N
+// has its functions named f.N and calls its own versions. The dispatch
+// module defines the roots (main and the exported functions) as stubs which
+// call the clone picked at load time.
+//-------------------------------------------------------------------------
+
+static bool is_root(unsigned sym, const unsigned *roots, size_t nroots)
+{
+	for (size_t i = 0; i < nroots; i++) {
+		if (roots[i] == sym)
+			return true;
+	}
+	return false;
+}
+
+// The CPUs a clone may be compiled for, with every feature the code for
+// each may use, as __builtin_cpu_supports names them.
+#define CPU_SSE42 "sse2,sse3,ssse3,sse4.1,sse4.2,popcnt"
+#define CPU_AVX CPU_SSE42 ",aes,pclmul,avx"
+#define CPU_AVX2 CPU_AVX ",f16c,avx2,fma,bmi,bmi2,lzcnt,movbe"
+#define CPU_AVX512 CPU_AVX2 ",adx,avx512f,avx512cd,avx512vl,avx512bw,avx512dq"
+#define CPU_ZEN CPU_AVX2 ",adx,sse4a"
+
+static const struct {
+	const char *name;
+	const char *features;
+} clone_cpus[] = {
+	{"x86-64", "sse2"},
+	{"core2", "sse2,sse3,ssse3"},
+	{"nehalem", CPU_SSE42},
+	{"corei7", CPU_SSE42},
+	{"westmere", CPU_SSE42 ",aes,pclmul"},
+	{"sandybridge", CPU_AVX},
+	{"corei7-avx", CPU_AVX},
+	{"ivybridge", CPU_AVX ",f16c"},
+	{"core-avx-i", CPU_AVX ",f16c"},
+	{"haswell", CPU_AVX2},
+	{"core-avx2", CPU_AVX2},
+	{"broadwell", CPU_AVX2 ",adx"},
+	{"skylake", CPU_AVX2 ",adx"},
+	{"skylake-avx512", CPU_AVX512},
+	{"cascadelake", CPU_AVX512 ",avx512vnni"},
+	{"icelake-server", CPU_AVX512 ",avx512vnni,avx512vbmi,avx512vbmi2,avx512ifma,"
+			   "avx512bitalg,avx512vpopcntdq,gfni,vaes,vpclmulqdq"},
+	{"znver1", CPU_ZEN},
+	{"znver2", CPU_ZEN},
+	{"znver3", CPU_ZEN ",vaes,vpclmulqdq"},
+	{"znver4", CPU_ZEN ",vaes,vpclmulqdq,avx512f,avx512cd,avx512vl,avx512bw,avx512dq,"
+		   "avx512vnni,avx512vbmi,avx512vbmi2,avx512ifma,avx512bitalg,"
+		   "avx512vpopcntdq,avx512bf16,gfni"},
+};
+
+// comma separated features of 'cpu', or 0 if it can't have a clone
+extern "C" const char *codegen_cpu_features(const char *cpu)
+{
+	for (size_t i = 0; i < sizeof(clone_cpus) / sizeof(clone_cpus[0]); i++) {
+		if (strcmp(clone_cpus[i].name, cpu) == 0)
+			return clone_cpus[i].features;
+	}
+	return 0;
+}
+
+static std::string clone_name(unsigned sym, int clone)
+{
+	return func_name(sym).str() + "." + llvm::utostr(clone);
+}
+
+// Turns a module of codegen into clone 'clone'. Only the roots are seen
+// from the outside, the rest may be inlined or dropped.
+extern "C" void codegen_clone(LLVMModuleRef module, struct binding *b,
+			      const unsigned *roots, size_t nroots, int clone)
+{
+	auto M = llvm::unwrap(module);
+	for (size_t i = 0; i < b->funcs_n; i++) {
+		struct stmt *s = b->funcs[i];
+		if (s->func.block == 0)
+			continue;
+		unsigned sym = s->func.ident->ident.sym;
+		auto F = M->getFunction(func_name(sym));
+		F->setName(clone_name(sym, clone));
+		if (!is_root(sym, roots, nroots))
+			F->setLinkage(llvm::Function::InternalLinkage);
+	}
+}
+
+// A stub for the root 'sym' which calls through 'impl'. Roots have double
+// signatures, see infer_types.
+static llvm::Function *codegen_stub(llvm::Module *M, llvm::IRBuilder<> &builder, unsigned sym,
+				   llvm::GlobalVariable *impl, const llvm::FunctionType *FT)
+{
+	auto F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, func_name(sym), M);
+	builder.SetInsertPoint(llvm::BasicBlock::Create(M->getContext(), "entry", F));
+
+	std::vector<llvm::Value*> args;
+	for (auto it = F->arg_begin(); it != F->arg_end(); it++)
+		args.push_back(it);
+	auto call = builder.CreateCall(builder.CreateLoad(impl, "impl"),
+				       args.begin(), args.end(), "calltmp");
+	call->setTailCall();
+	builder.CreateRet(call);
+	return F;
+}
+
+// The dispatch module for 'nclones' clones, clone N compiled for cpus[N].
+// Clone 0 is the baseline and the initial target of the stubs. A global
+// constructor, which runs before main like an IFUNC resolver, switches
+// them to the last clone whose features (see codegen_cpu_features) the
+// runtime's _anc_cpu_supports all accepts.
+extern "C" LLVMModuleRef codegen_dispatch(LLVMContextRef context, struct binding *b,
+					  const unsigned *roots, size_t nroots,
+					  const char **cpus, int nclones)
+{
+	auto &C = *llvm::unwrap(context);
+	auto M = new llvm::Module("dispatch", C);
+	llvm::IRBuilder<> builder(C);
+	auto type_double = llvm::Type::getDoubleTy(C);
+	auto type_i32 = llvm::Type::getInt32Ty(C);
+
+	// clones of every root, and the pointer its stub calls through
+	std::vector<std::vector<llvm::Function*> > clones;
+	std::vector<llvm::GlobalVariable*> impls;
+	for (size_t i = 0; i < b->funcs_n; i++) {
+		struct stmt *s = b->funcs[i];
+		unsigned sym = s->func.ident->ident.sym;
+		if (s->func.block == 0 || !is_root(sym, roots, nroots))
+			continue;
+
+		int numargs = s->func.args ? s->func.args->v_n : 0;
+		std::vector<const llvm::Type*> types(numargs, type_double);
+		auto FT = llvm::FunctionType::get(type_double, types, false);
+		std::vector<llvm::Function*> fs(nclones);
+		for (int k = 0; k < nclones; k++)
+			fs[k] = llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
+						       clone_name(sym, k), M);
+
+		auto impl = new llvm::GlobalVariable(*M, llvm::PointerType::getUnqual(FT), false,
+						     llvm::GlobalValue::InternalLinkage, fs[0],
+						     func_name(sym).str() + ".impl");
+		codegen_stub(M, builder, sym, impl, FT);
+		clones.push_back(fs);
+		impls.push_back(impl);
+	}
+
+	auto VT = llvm::FunctionType::get(llvm::Type::getVoidTy(C), false);
+	auto resolve = llvm::Function::Create(VT, llvm::Function::InternalLinkage,
+					      "_anc_resolve", M);
+	std::vector<const llvm::Type*> params(1, llvm::Type::getInt8PtrTy(C));
+	auto supports = llvm::Function::Create(llvm::FunctionType::get(type_i32, params, false),
+					       llvm::Function::ExternalLinkage,
+					       "_anc_cpu_supports", M);
+	builder.SetInsertPoint(llvm::BasicBlock::Create(C, "entry", resolve));
+
+	// newest CPU first, nothing to do for the baseline
+	for (int k = nclones - 1; k > 0; k--) {
+		auto next = llvm::BasicBlock::Create(C, "next", resolve);
+		llvm::StringRef rest = codegen_cpu_features(cpus[k]);
+		while (!rest.empty()) {
+			auto feature = rest.split(',');
+			rest = feature.second;
+			auto name = builder.CreateGlobalStringPtr(feature.first.str().c_str(),
+								  "feature");
+			auto ok = builder.CreateICmpNE(builder.CreateCall(supports, name, "supported"),
+						       llvm::ConstantInt::get(type_i32, 0), "oktmp");
+			auto check = llvm::BasicBlock::Create(C, "check", resolve);
+			builder.CreateCondBr(ok, check, next);
+			builder.SetInsertPoint(check);
+		}
+
+		for (size_t j = 0; j < impls.size(); j++)
+			builder.CreateStore(clones[j][k], impls[j]);
+		builder.CreateRetVoid();
+		builder.SetInsertPoint(next);
+	}
+	builder.CreateRetVoid();
+
+	std::vector<const llvm::Type*> fields;
+	fields.push_back(type_i32);
+	fields.push_back(llvm::PointerType::getUnqual(VT));
+	std::vector<llvm::Constant*> ctor;
+	ctor.push_back(llvm::ConstantInt::get(type_i32, 65535));
+	ctor.push_back(resolve);
+	std::vector<llvm::Constant*> ctors(1, llvm::ConstantStruct::get(C, ctor, false));
+	auto AT = llvm::ArrayType::get(llvm::StructType::get(C, fields, false), 1);
+	new llvm::GlobalVariable(*M, AT, false, llvm::GlobalValue::AppendingLinkage,
+				 llvm::ConstantArray::get(AT, ctors), "llvm.global_ctors");
+	return wrap(M);
+}
@@ -0,0 +1,38 @@
+#include <stdlib.h>
+#include "parser.h"
+
+// The compiler as a library. Every compilation has its own parser, AST,
+// binding and LLVM context, the symbol table is the only thing shared and
+// it takes a lock.
+
+int compile_init(void)
+{
+	return codegen_start_threads();
+}
+
+LLVMModuleRef compile(LLVMContextRef context, const char *source, size_t len)
+{
+	struct parser_context ctx;
+	struct binding b;
+	LLVMModuleRef module = 0;
+
+	// the scanner doesn't write to the buffer
+	init_context(&ctx);
+	parse_buffer(&ctx, (char*)source, len);
+	if (ctx.failed) {
+		free_context(&ctx);
+		return 0;
+	}
+
+	unsigned root = intern("main", 4);
+	prune_functions(ctx.result, &root, 1);
+	fold_ast(ctx.result, 0);
+	if (!bind_ast(&b, ctx.result)) {
+		infer_types(&b, &root, 1);
+		module = codegen(context, ctx.result, &b);
+	}
+
+	free_binding(&b);
+	free_context(&ctx);
+	return module;
+}
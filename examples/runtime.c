@@ -1,8 +1,36 @@
 #include <stdio.h>
+#include <string.h>
 #include <SDL/SDL.h>
 
 extern double _anc_main();
 
+// Whether this host has 'feature', asked by the resolver of multiversioned
+// programs (ancient --clones=...) before main for every feature of a clone.
+// __builtin_cpu_supports only takes literals.
+int _anc_cpu_supports(const char *feature)
+{
+#define FEATURE(name) \
+	if (strcmp(feature, name) == 0) \
+		return __builtin_cpu_supports(name)
+
+	// constructors may run before the one of libgcc
+	__builtin_cpu_init();
+	FEATURE("sse2"); FEATURE("sse3"); FEATURE("ssse3"); FEATURE("sse4.1");
+	FEATURE("sse4.2"); FEATURE("sse4a"); FEATURE("popcnt"); FEATURE("aes");
+	FEATURE("pclmul"); FEATURE("avx"); FEATURE("f16c"); FEATURE("avx2");
+	FEATURE("fma"); FEATURE("bmi"); FEATURE("bmi2"); FEATURE("lzcnt");
+	FEATURE("movbe"); FEATURE("adx"); FEATURE("avx512f"); FEATURE("avx512cd");
+	FEATURE("avx512vl"); FEATURE("avx512bw"); FEATURE("avx512dq");
+	FEATURE("avx512vnni"); FEATURE("avx512vbmi"); FEATURE("avx512vbmi2");
+	FEATURE("avx512ifma"); FEATURE("avx512bitalg"); FEATURE("avx512vpopcntdq");
+	FEATURE("avx512bf16"); FEATURE("gfni"); FEATURE("vaes"); FEATURE("vpclmulqdq");
+#undef FEATURE
+
+	// a clone needing something unknown here is never picked
+	fprintf(stderr, "unknown CPU feature: %s\n", feature);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	printf("%f\n", _anc_main());
@@ -0,0 +1,375 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "parser.h"
+
+// Flattening state. With a binding (see flatten_bound), each node also gets
+// its 'bound' entry.
+struct flattener {
+	struct flat_ast *fa;
+	int bound;
+
+	// first copies of the shared expressions, open addressing by pointer
+	struct shared_copy *shared;
+	size_t shared_n;
+	size_t shared_alloc;
+};
+
+struct shared_copy {
+	struct expr *e;
+	unsigned i;
+};
+
+static unsigned flat_node(struct flattener *fl, enum flat_kind kind, unsigned data)
+{
+	struct flat_ast *fa = fl->fa;
+	if (fa->n == fa->alloc) {
+		fa->alloc = ALLOC_NR(fa->alloc);
+		fa->kind = realloc(fa->kind, fa->alloc * sizeof(fa->kind[0]));
+		fa->data = realloc(fa->data, fa->alloc * sizeof(fa->data[0]));
+		fa->next = realloc(fa->next, fa->alloc * sizeof(fa->next[0]));
+		if (fl->bound)
+			fa->bound = realloc(fa->bound, fa->alloc * sizeof(fa->bound[0]));
+	}
+	unsigned i = fa->n++;
+	fa->kind[i] = kind;
+	fa->data[i] = data;
+	if (fl->bound)
+		fa->bound[i] = 0;
+	return i;
+}
+
+// closes the subtree of the node 'i', everything added since is its children
+static void flat_end(struct flattener *fl, unsigned i)
+{
+	fl->fa->next[i] = fl->fa->n;
+}
+
+static size_t hash_ptr(struct expr *e)
+{
+	uint64_t h = (uintptr_t)e * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+static void grow_shared(struct flattener *fl)
+{
+	struct shared_copy *old = fl->shared;
+	size_t oldalloc = fl->shared_alloc;
+	size_t i;
+
+	fl->shared_alloc = oldalloc ? oldalloc * 2 : 256;
+	fl->shared = calloc(fl->shared_alloc, sizeof(struct shared_copy));
+	for (i = 0; i < oldalloc; i++) {
+		if (!old[i].e)
+			continue;
+		size_t j = hash_ptr(old[i].e) & (fl->shared_alloc - 1);
+		while (fl->shared[j].e)
+			j = (j + 1) & (fl->shared_alloc - 1);
+		fl->shared[j] = old[i];
+	}
+	free(old);
+}
+
+// flat index of the first copy of the shared 'e', 'i' if it's this one
+static unsigned first_copy(struct flattener *fl, struct expr *e, unsigned i)
+{
+	if ((fl->shared_n + 1) * 2 > fl->shared_alloc)
+		grow_shared(fl);
+
+	size_t mask = fl->shared_alloc - 1;
+	size_t j = hash_ptr(e) & mask;
+	for (; fl->shared[j].e; j = (j + 1) & mask) {
+		if (fl->shared[j].e == e)
+			return fl->shared[j].i;
+	}
+	fl->shared[j].e = e;
+	fl->shared[j].i = i;
+	fl->shared_n++;
+	return i;
+}
+
+static unsigned bind_ident(struct expr *ident)
+{
+	if (ident->ident.bind == BIND_LOCAL)
+		return ident->ident.index;
+	return ident->ident.index | FLAT_BOUND_FUNC;
+}
+
+static void flatten_expr(struct flattener *fl, struct expr *e)
+{
+	struct flat_ast *fa = fl->fa;
+	unsigned i;
+	size_t j;
+
+	switch (e->type) {
+	case EXPR_NUM:
+		i = flat_node(fl, FLAT_NUM, fa->nums_n);
+		ARRAY_APPEND(fa->nums, e->num);
+		break;
+	case EXPR_BIN:
+		i = flat_node(fl, FLAT_BIN, e->bin.tok);
+		if (fl->bound) {
+			if (e->wide)
+				fa->bound[i] |= FLAT_BOUND_WIDE;
+			if (e->consed)
+				fa->bound[i] |= FLAT_BOUND_SHARED | first_copy(fl, e, i);
+		}
+		flatten_expr(fl, e->bin.lhs);
+		flatten_expr(fl, e->bin.rhs);
+		break;
+	case EXPR_IDENT:
+		i = flat_node(fl, FLAT_IDENT, e->ident.sym);
+		if (fl->bound)
+			fa->bound[i] = bind_ident(e);
+		break;
+	case EXPR_CALL:
+		i = flat_node(fl, FLAT_CALL, e->call.ident->ident.sym);
+		if (fl->bound)
+			fa->bound[i] = bind_ident(e->call.ident);
+		for (j = 0; j < e->call.args->v_n; j++)
+			flatten_expr(fl, e->call.args->v[j]);
+		break;
+	}
+	flat_end(fl, i);
+}
+
+static void flatten_block(struct flattener *fl, struct stmts *ss);
+
+static void flatten_stmt(struct flattener *fl, struct stmt *s)
+{
+	unsigned i;
+	size_t j;
+
+	switch (s->type) {
+	case STMT_EXPR:
+		flatten_expr(fl, s->expr);
+		return;
+	case STMT_ASSIGN:
+		i = flat_node(fl, FLAT_ASSIGN, 0);
+		flatten_expr(fl, s->assign.ident);
+		flatten_expr(fl, s->assign.rhs);
+		break;
+	case STMT_BLOCK:
+		flatten_block(fl, s->block);
+		return;
+	case STMT_IFELSE:
+		i = flat_node(fl, FLAT_IFELSE, 0);
+		flatten_expr(fl, s->ifelse.cond);
+		flatten_block(fl, s->ifelse.block->block);
+		if (s->ifelse.elseblock)
+			flatten_block(fl, s->ifelse.elseblock->block);
+		break;
+	case STMT_FOR:
+		i = flat_node(fl, FLAT_FOR, 0);
+		flatten_expr(fl, s->forloop.cond);
+		flatten_block(fl, s->forloop.block->block);
+		break;
+	case STMT_FUNC:
+		j = s->func.args ? s->func.args->v_n : 0;
+		i = flat_node(fl, FLAT_FUNC, s->func.fast ? j | FLAT_FAST : j);
+		flatten_expr(fl, s->func.ident);
+		if (s->func.args) {
+			for (j = 0; j < s->func.args->v_n; j++)
+				flatten_expr(fl, s->func.args->v[j]);
+		}
+		if (s->func.block)
+			flatten_block(fl, s->func.block->block);
+		break;
+	case STMT_VAR:
+		i = flat_node(fl, FLAT_VAR, 0);
+		flatten_expr(fl, s->var.ident);
+		if (s->var.init)
+			flatten_expr(fl, s->var.init);
+		break;
+	case STMT_RETURN:
+		i = flat_node(fl, FLAT_RETURN, 0);
+		if (s->ret)
+			flatten_expr(fl, s->ret);
+		break;
+	}
+	flat_end(fl, i);
+}
+
+static void flatten_block(struct flattener *fl, struct stmts *ss)
+{
+	unsigned i = flat_node(fl, FLAT_BLOCK, 0);
+	size_t j;
+	for (j = 0; j < ss->v_n; j++)
+		flatten_stmt(fl, ss->v[j]);
+	flat_end(fl, i);
+}
+
+struct flat_ast *flatten_ast(struct stmts *top)
+{
+	struct flattener fl = {calloc(1, sizeof(struct flat_ast))};
+	flatten_block(&fl, top);
+	return fl.fa;
+}
+
+// The flat AST of a bound tree, after infer_types. Along with the nodes it
+// keeps what codegen_flat needs of 'b' and the types, neither the tree nor
+// 'b' are referred to.
+struct flat_ast *flatten_bound(struct stmts *top, struct binding *b)
+{
+	struct flattener fl = {calloc(1, sizeof(struct flat_ast)), 1};
+	struct flat_ast *fa = fl.fa;
+	size_t i, j;
+
+	for (i = 0; i < b->funcs_n; i++) {
+		struct stmt *s = b->funcs[i];
+		struct flat_func f;
+		f.sym = s->func.ident->ident.sym;
+		f.nargs = s->func.args ? s->func.args->v_n : 0;
+		f.nslots = s->func.nslots;
+		f.types = fa->types_n;
+		f.rettype = s->func.rettype;
+		ARRAY_APPEND(fa->funcs, f);
+
+		size_t ntypes = f.nslots > f.nargs ? f.nslots : f.nargs;
+		for (j = 0; j < ntypes; j++) {
+			enum value_type t = s->func.types ? s->func.types[j] : TYPE_DOUBLE;
+			ARRAY_APPEND(fa->types, t);
+		}
+	}
+
+	flatten_block(&fl, top);
+	free(fl.shared);
+	return fa;
+}
+
+void free_flat_ast(struct flat_ast *fa)
+{
+	free(fa->bound);
+	FREE_ARRAY(fa->funcs);
+	FREE_ARRAY(fa->types);
+	if (fa->map) {
+		munmap(fa->map, fa->map_len);
+		free(fa);
+		return;
+	}
+	free(fa->kind);
+	free(fa->data);
+	free(fa->next);
+	FREE_ARRAY(fa->nums);
+	free(fa);
+}
+
+size_t flat_ast_bytes(struct flat_ast *fa)
+{
+	size_t node = sizeof(fa->kind[0]) + sizeof(fa->data[0]) + sizeof(fa->next[0]);
+	if (fa->bound)
+		node += sizeof(fa->bound[0]);
+	return fa->n * node + fa->nums_n * sizeof(fa->nums[0]) +
+	       fa->funcs_n * sizeof(fa->funcs[0]) + fa->types_n * sizeof(fa->types[0]);
+}
+
+//------------------------------------------------------------------------------
+// Back to the pointer tree, used for the ASTs loaded from the cache.
+//------------------------------------------------------------------------------
+
+static struct expr *unflatten_expr(struct parser_context *ctx, struct flat_ast *fa,
+				   unsigned i)
+{
+	struct expr *ident;
+	struct args *args = 0;
+	unsigned j;
+
+	switch (fa->kind[i]) {
+	case FLAT_NUM:
+		return new_num_expr(ctx, fa->nums[fa->data[i]]);
+	case FLAT_BIN:
+		return new_binary_expr(ctx, fa->data[i],
+				       unflatten_expr(ctx, fa, i+1),
+				       unflatten_expr(ctx, fa, fa->next[i+1]));
+	case FLAT_CALL:
+		ident = new_ident_expr(ctx, fa->data[i]);
+		for (j = i+1; j < fa->next[i]; j = fa->next[j]) {
+			struct expr *e = unflatten_expr(ctx, fa, j);
+			if (args)
+				append_arg(ctx, args, e);
+			else
+				args = new_args(ctx, e);
+		}
+		return new_call_expr(ctx, ident, args);
+	}
+	return new_ident_expr(ctx, fa->data[i]);
+}
+
+static struct stmt *unflatten_block(struct parser_context *ctx,
+				    struct flat_ast *fa, unsigned i);
+
+static struct stmt *unflatten_stmt(struct parser_context *ctx, struct flat_ast *fa,
+				   unsigned i)
+{
+	unsigned c = i+1, end = fa->next[i];
+	struct expr *ident, *e = 0;
+	struct stmt *s, *b1, *b2 = 0;
+	struct args *args = 0;
+	unsigned j;
+
+	switch (fa->kind[i]) {
+	case FLAT_ASSIGN:
+		ident = unflatten_expr(ctx, fa, c);
+		return new_assign_stmt(ctx, ident, unflatten_expr(ctx, fa, fa->next[c]));
+	case FLAT_BLOCK:
+		return unflatten_block(ctx, fa, i);
+	case FLAT_IFELSE:
+		e = unflatten_expr(ctx, fa, c);
+		c = fa->next[c];
+		b1 = unflatten_block(ctx, fa, c);
+		if (fa->next[c] < end)
+			b2 = unflatten_block(ctx, fa, fa->next[c]);
+		return new_ifelse_stmt(ctx, e, b1, b2);
+	case FLAT_FOR:
+		e = unflatten_expr(ctx, fa, c);
+		return new_for_stmt(ctx, e, unflatten_block(ctx, fa, fa->next[c]));
+	case FLAT_FUNC:
+		ident = unflatten_expr(ctx, fa, c);
+		c = fa->next[c];
+		for (j = 0; j < flat_func_nargs(fa, i); j++, c = fa->next[c]) {
+			e = unflatten_expr(ctx, fa, c);
+			if (args)
+				append_arg(ctx, args, e);
+			else
+				args = new_args(ctx, e);
+		}
+		s = new_func_stmt(ctx, ident, args,
+				  c < end ? unflatten_block(ctx, fa, c) : 0);
+		s->func.fast = (fa->data[i] & FLAT_FAST) != 0;
+		return s;
+	case FLAT_VAR:
+		ident = unflatten_expr(ctx, fa, c);
+		if (fa->next[c] < end)
+			e = unflatten_expr(ctx, fa, fa->next[c]);
+		return new_var_stmt(ctx, ident, e);
+	case FLAT_RETURN:
+		if (c < end)
+			e = unflatten_expr(ctx, fa, c);
+		return new_return_stmt(ctx, e);
+	}
+	return new_expr_stmt(ctx, unflatten_expr(ctx, fa, i));
+}
+
+static struct stmts *unflatten_stmts(struct parser_context *ctx,
+				     struct flat_ast *fa, unsigned i)
+{
+	struct stmts *ss = new_stmts(ctx, unflatten_stmt(ctx, fa, i+1));
+	unsigned j;
+	for (j = fa->next[i+1]; j < fa->next[i]; j = fa->next[j])
+		append_stmt(ctx, ss, unflatten_stmt(ctx, fa, j));
+	return ss;
+}
+
+static struct stmt *unflatten_block(struct parser_context *ctx,
+				    struct flat_ast *fa, unsigned i)
+{
+	return new_block_stmt(ctx, unflatten_stmts(ctx, fa, i));
+}
+
+// Nodes are allocated in the context's arena, the tree doesn't refer to
+// 'fa', it can be freed right away.
+struct stmts *unflatten_ast(struct parser_context *ctx, struct flat_ast *fa)
+{
+	struct stmts *top = unflatten_stmts(ctx, fa, 0);
+	shrink_ast(ctx);
+	return top;
+}
@@ -0,0 +1,165 @@
+#include <string.h>
+#include "parser.h"
+#include "grammar.h"
+
+// Constant folding and algebraic identities over the AST, before codegen.
+//
+// Nodes are rewritten in place: a shared (hash-consed) node has the same
+// subtree under every parent, so it folds the same way for all of them and
+// the second visit finds it done. Each rewrite turns a binary expression
+// and its two operands into one node, the count of removed nodes is two
+// per rewrite.
+//
+// Functions declared 'fast' (or all of them with --fast-math) get the
+// rewrites of fast_identity and x - x as 0 too, which ignore signed zeroes,
+// NaNs and infinities. With the constant rewrites of codegen_binop that is
+// all fast-math does, an accumulator summed over a loop stays in order.
+
+static int is_num(struct expr *e, double num)
+{
+	return e->type == EXPR_NUM && memcmp(&e->num, &num, sizeof(num)) == 0;
+}
+
+static double eval_binop(int tok, double a, double b)
+{
+	switch (tok) {
+	case PLUS: return a + b;
+	case MINUS: return a - b;
+	case TIMES: return a * b;
+	case DIVIDE: return a / b;
+	}
+	// LESS, codegen uses an unordered compare: true if either is a NaN
+	return !(a >= b);
+}
+
+// Returns the operand 'e' reduces to, if any. These hold for every double,
+// including NaNs and signed zeroes. Note that x+0 is not one of them:
+// -0.0 + 0.0 is 0.0, but x + -0.0 is always x.
+static struct expr *identity(struct expr *e)
+{
+	struct expr *lhs = e->bin.lhs, *rhs = e->bin.rhs;
+	switch (e->bin.tok) {
+	case PLUS:
+		if (is_num(rhs, -0.0))
+			return lhs;
+		if (is_num(lhs, -0.0))
+			return rhs;
+		break;
+	case MINUS:
+		if (is_num(rhs, 0.0))
+			return lhs;
+		break;
+	case TIMES:
+		if (is_num(rhs, 1.0))
+			return lhs;
+		if (is_num(lhs, 1.0))
+			return rhs;
+		break;
+	case DIVIDE:
+		if (is_num(rhs, 1.0))
+			return lhs;
+		break;
+	}
+	return 0;
+}
+
+// x+0 and 0+x are x, wrong for x = -0.0 only
+static struct expr *fast_identity(struct expr *e)
+{
+	struct expr *lhs = e->bin.lhs, *rhs = e->bin.rhs;
+	switch (e->bin.tok) {
+	case PLUS:
+		if (is_num(rhs, 0.0))
+			return lhs;
+		if (is_num(lhs, 0.0))
+			return rhs;
+		break;
+	}
+	return 0;
+}
+
+static size_t fold_expr(struct expr *e, int fast)
+{
+	size_t removed = 0;
+	size_t i;
+
+	switch (e->type) {
+	case EXPR_BIN:
+		removed += fold_expr(e->bin.lhs, fast);
+		removed += fold_expr(e->bin.rhs, fast);
+		if (e->bin.lhs->type == EXPR_NUM && e->bin.rhs->type == EXPR_NUM) {
+			double num = eval_binop(e->bin.tok, e->bin.lhs->num, e->bin.rhs->num);
+			e->type = EXPR_NUM;
+			e->num = num;
+			removed += 2;
+		} else if (fast && e->bin.tok == MINUS && e->bin.lhs == e->bin.rhs) {
+			// x-x, a shared operand is the same value on both sides
+			// (calls are never shared), wrong for infinities and NaNs
+			e->type = EXPR_NUM;
+			e->num = 0.0;
+			removed += 2;
+		} else {
+			struct expr *x = identity(e);
+			if (!x && fast)
+				x = fast_identity(e);
+			if (x) {
+				*e = *x;
+				removed += 2;
+			}
+		}
+		break;
+	case EXPR_CALL:
+		for (i = 0; i < e->call.args->v_n; i++)
+			removed += fold_expr(e->call.args->v[i], fast);
+		break;
+	default:
+		break;
+	}
+	return removed;
+}
+
+static size_t fold_stmts(struct stmts *ss, int fast);
+
+static size_t fold_stmt(struct stmt *s, int fast)
+{
+	switch (s->type) {
+	case STMT_EXPR:
+		return fold_expr(s->expr, fast);
+	case STMT_ASSIGN:
+		return fold_expr(s->assign.rhs, fast);
+	case STMT_BLOCK:
+		return fold_stmts(s->block, fast);
+	case STMT_IFELSE:
+		return fold_expr(s->ifelse.cond, fast) +
+			fold_stmts(s->ifelse.block->block, fast) +
+			(s->ifelse.elseblock ?
+			 fold_stmts(s->ifelse.elseblock->block, fast) : 0);
+	case STMT_FOR:
+		return fold_expr(s->forloop.cond, fast) +
+			fold_stmts(s->forloop.block->block, fast);
+	case STMT_FUNC:
+		s->func.fast |= fast;
+		return s->func.block ? fold_stmts(s->func.block->block, s->func.fast) : 0;
+	case STMT_VAR:
+		return s->var.init ? fold_expr(s->var.init, fast) : 0;
+	case STMT_RETURN:
+		return s->ret ? fold_expr(s->ret, fast) : 0;
+	}
+	return 0;
+}
+
+static size_t fold_stmts(struct stmts *ss, int fast)
+{
+	size_t removed = 0;
+	size_t i;
+	for (i = 0; i < ss->v_n; i++)
+		removed += fold_stmt(ss->v[i], fast);
+	return removed;
+}
+
+// Returns the number of nodes removed from the tree. With 'fast_math' every
+// function is made a fast one.
+size_t fold_ast(struct stmts *top, int fast_math)
+{
+	return fold_stmts(top, fast_math);
+}
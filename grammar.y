@@ -9,70 +9,85 @@
 	#include <assert.h>
 	#include "grammar.h"
 	#include "parser.h"
-
-	struct stmts *SSS;
 }
 
 %extra_argument { struct parser_context *ctx }
 
 %syntax_error {
-	print_syntax_error(ctx, "Syntax error, unexpected token '%s' on line: %d",
-			   tokname(ctx->lasttoken), ctx->line);
-	exit(1);
+	// only the first one is reported, see emit_token
+	if (!ctx->failed)
+		print_syntax_error(ctx, "Syntax error, unexpected token '%s' on line: %d",
+				   tokname(ctx->lasttoken), ctx->line);
+	ctx->failed = 1;
 }
 
-program ::= stmts(A). { SSS = A; }
+program ::= stmts(A). { ctx->result = A; }
 
 //-------------------------------------------------------------------------
 // ident
 //-------------------------------------------------------------------------
 %type ident { struct expr* }
-ident(A) ::= IDENT(B). { A = new_ident_expr(B.ident.beg, B.ident.len); }
+ident(A) ::= IDENT(B). { A = new_ident_expr(ctx, B.sym); }
 
 //-------------------------------------------------------------------------
 // stmts
 //-------------------------------------------------------------------------
 %type stmts { struct stmts* }
-stmts(A) ::= stmt(B). { A = new_stmts(B); }
-stmts(A) ::= stmts(B) stmt(C). { ARRAY_APPEND(B->v, C); A = B; }
+stmts(A) ::= stmt(B). { A = new_stmts(ctx, B); }
+stmts(A) ::= stmts(B) stmt(C). { append_stmt(ctx, B, C); A = B; }
 
 //-------------------------------------------------------------------------
 // stmt
 //-------------------------------------------------------------------------
 %type stmt { struct stmt* }
-stmt(A) ::= expr(B) SEMICOLON. { A = new_expr_stmt(B); } // expr stmt
-stmt(A) ::= ident(B) EQUALS expr(C) SEMICOLON. { A = new_assign_stmt(B, C); }
-stmt(A) ::= VAR ident(B) EQUALS expr(C) SEMICOLON. { A = new_var_stmt(B, C); }
-stmt(A) ::= VAR ident(B) SEMICOLON. { A = new_var_stmt(B, 0); }
-stmt(A) ::= RET expr(B) SEMICOLON. { A = new_return_stmt(B); }
-stmt(A) ::= RET SEMICOLON. { A = new_return_stmt(0); }
+stmt(A) ::= expr(B) SEMICOLON. { A = new_expr_stmt(ctx, B); } // expr stmt
+stmt(A) ::= ident(B) EQUALS expr(C) SEMICOLON. { A = new_assign_stmt(ctx, B, C); }
+stmt(A) ::= VAR ident(B) EQUALS expr(C) SEMICOLON. { A = new_var_stmt(ctx, B, C); }
+stmt(A) ::= VAR ident(B) SEMICOLON. { A = new_var_stmt(ctx, B, 0); }
+stmt(A) ::= RET expr(B) SEMICOLON. { A = new_return_stmt(ctx, B); }
+stmt(A) ::= RET SEMICOLON. { A = new_return_stmt(ctx, 0); }
 
 // just a helper for block-based statements (func, if/else, for)
 %type block { struct stmt* }
-block(A) ::= LBRACE stmts(B) RBRACE. { A = new_block_stmt(B); }
+block(A) ::= LBRACE stmts(B) RBRACE. { A = new_block_stmt(ctx, B); }
 
 stmt(A) ::= block(B). { A = B; } // block stmt itself
-stmt(A) ::= IF expr(B) block(C). { A = new_ifelse_stmt(B, C, 0); } // if alone
-stmt(A) ::= IF expr(B) block(C) ELSE block(D). { A = new_ifelse_stmt(B, C, D); }
+stmt(A) ::= IF expr(B) block(C). { A = new_ifelse_stmt(ctx, B, C, 0); } // if alone
+stmt(A) ::= IF expr(B) block(C) ELSE block(D). { A = new_ifelse_stmt(ctx, B, C, D); }
 stmt(A) ::= FOR expr(COND) block(B).
 {
-	A = new_for_stmt(COND, B);
+	A = new_for_stmt(ctx, COND, B);
 }
 stmt(A) ::= FUNC ident(NAME) LPAREN args(ARGS) RPAREN block(B).
 {
-	A = new_func_stmt(NAME, ARGS, B);
+	A = new_func_stmt(ctx, NAME, ARGS, B);
 }
 stmt(A) ::= FUNC ident(NAME) block(B).
 {
-	A = new_func_stmt(NAME, 0, B);
+	A = new_func_stmt(ctx, NAME, 0, B);
+}
+stmt(A) ::= modifier(M) FUNC ident(NAME) LPAREN args(ARGS) RPAREN block(B).
+{
+	A = new_func_stmt(ctx, NAME, ARGS, B);
+	A->func.fast = M;
 }
+stmt(A) ::= modifier(M) FUNC ident(NAME) block(B).
+{
+	A = new_func_stmt(ctx, NAME, 0, B);
+	A->func.fast = M;
+}
+
+// 'fast' is not a keyword, variables and functions may be named so, it is
+// only a modifier right before func
+%type modifier { int }
+modifier(A) ::= IDENT(B). { A = func_modifier(ctx, B.sym); }
 stmt(A) ::= FOREIGN ident(NAME) LPAREN args(ARGS) RPAREN SEMICOLON.
 {
-	A = new_func_stmt(NAME, ARGS, 0);
+	A = new_func_stmt(ctx, NAME, ARGS, 0);
 }
 stmt(A) ::= FOREIGN ident(NAME) SEMICOLON.
 {
-	A = new_func_stmt(NAME, 0, 0);
+	A = new_func_stmt(ctx, NAME, 0, 0);
 }
 
 //-------------------------------------------------------------------------
@@ -80,18 +95,18 @@ stmt(A) ::= FOREIGN ident(NAME) SEMICOLON.
 //-------------------------------------------------------------------------
 %type expr { struct expr* }
 expr(A) ::= LPAREN expr(B) RPAREN. { A = B; }
-expr(A) ::= expr(B) MINUS expr(C). { A = new_binary_expr(MINUS, B, C); }
-expr(A) ::= expr(B) PLUS expr(C). { A = new_binary_expr(PLUS, B, C); }
-expr(A) ::= expr(B) TIMES expr(C). { A = new_binary_expr(TIMES, B, C); }
-expr(A) ::= expr(B) DIVIDE expr(C). { A = new_binary_expr(DIVIDE, B, C); }
-expr(A) ::= expr(B) LESS expr(C). { A = new_binary_expr(LESS, B, C); }
-expr(A) ::= DOUBLE(B). { A = new_num_expr(B.num); }
+expr(A) ::= expr(B) MINUS expr(C). { A = new_binary_expr(ctx, MINUS, B, C); }
+expr(A) ::= expr(B) PLUS expr(C). { A = new_binary_expr(ctx, PLUS, B, C); }
+expr(A) ::= expr(B) TIMES expr(C). { A = new_binary_expr(ctx, TIMES, B, C); }
+expr(A) ::= expr(B) DIVIDE expr(C). { A = new_binary_expr(ctx, DIVIDE, B, C); }
+expr(A) ::= expr(B) LESS expr(C). { A = new_binary_expr(ctx, LESS, B, C); }
+expr(A) ::= DOUBLE(B). { A = new_num_expr(ctx, B.num); }
 expr(A) ::= ident(B). { A = B; }
-expr(A) ::= ident(B) LPAREN args(C) RPAREN. { A = new_call_expr(B, C); }
+expr(A) ::= ident(B) LPAREN args(C) RPAREN. { A = new_call_expr(ctx, B, C); }
 
 //-------------------------------------------------------------------------
 // args (expr list, delimiter: ',')
 //-------------------------------------------------------------------------
 %type args { struct args* }
-args(A) ::= expr(B). { A = new_args(B); }
-args(A) ::= args(B) COMMA expr(C). { ARRAY_APPEND(B->v, C); A = B; }
+args(A) ::= expr(B). { A = new_args(ctx, B); }
+args(A) ::= args(B) COMMA expr(C). { append_arg(ctx, B, C); A = B; }
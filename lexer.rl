@@ -0,0 +1,273 @@
+// vim: filetype=ragel
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include "grammar.h"
+#include "parser.h"
+
+// The scanner, it feeds the tokens to the lemon parser as they are found.
+
+// lemon parser definitions
+void *ParseAlloc(void*(*)(size_t));
+void ParseFree(void*, void(*)(void*));
+void Parse(void*, int, struct token, struct parser_context*);
+
+%%{
+	machine ancient;
+
+	newline = '\n' @{new_line(ctx, p);};
+	any_count_line = any | newline;
+
+	c_comment := any_count_line* :>> '*/' @{fgoto main;};
+
+	main := |*
+
+	# skip spaces
+	any_count_line - 0x21..0x7e;
+
+	# skip C++ comments
+	'//' [^\n]* newline;
+
+	# skip C comments
+	'/*' {fgoto c_comment;};
+
+	# integers
+	digit+ { emit_double(ctx, ts, te); };
+	'0' [xX] xdigit+ { emit_double(ctx, ts, te); };
+
+	# floats
+	exponent = [eE] [+\-]? digit+;
+	digit+ '.' digit+ exponent? { emit_double(ctx, ts, te); };
+	digit+ exponent { emit_double(ctx, ts, te); };
+
+	# punctuation stuff
+	'+' { emit_symbol(ctx, PLUS, ts); };
+	'-' { emit_symbol(ctx, MINUS, ts); };
+	'*' { emit_symbol(ctx, TIMES, ts); };
+	'/' { emit_symbol(ctx, DIVIDE, ts); };
+	'<' { emit_symbol(ctx, LESS, ts); };
+	'(' { emit_symbol(ctx, LPAREN, ts); };
+	')' { emit_symbol(ctx, RPAREN, ts); };
+	';' { emit_symbol(ctx, SEMICOLON, ts); };
+	'=' { emit_symbol(ctx, EQUALS, ts); };
+	',' { emit_symbol(ctx, COMMA, ts); };
+	'{' { emit_symbol(ctx, LBRACE, ts); };
+	'}' { emit_symbol(ctx, RBRACE, ts); };
+
+	# keywords
+	'if'      { emit_symbol(ctx, IF, ts); };
+	'else'    { emit_symbol(ctx, ELSE, ts); };
+	'for'     { emit_symbol(ctx, FOR, ts); };
+	'func'    { emit_symbol(ctx, FUNC, ts); };
+	'foreign' { emit_symbol(ctx, FOREIGN, ts); };
+	'var'     { emit_symbol(ctx, VAR, ts); };
+	'return'  { emit_symbol(ctx, RET, ts); };
+
+	alnum_u = alnum | '_';
+	alpha_u = alpha | '_';
+
+	alpha_u alnum_u* { emit_ident(ctx, ts, te-ts); };
+
+	*|;
+}%%
+
+%% write data;
+
+#define TOKEN_BATCH 4096
+
+static void new_line(struct parser_context *ctx, char *p)
+{
+	ctx->line++;
+	ARRAY_APPEND(ctx->lines, ctx->base + (p + 1 - ctx->buf));
+}
+
+void init_context(struct parser_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->lemon = ParseAlloc(malloc);
+	ctx->line = 1;
+	ctx->lasttoken = -1;
+}
+
+// releases the parser, the AST and the line index
+void free_context(struct parser_context *ctx)
+{
+	ParseFree(ctx->lemon, free);
+	free_ast(ctx);
+	FREE_ARRAY(ctx->lines);
+}
+
+// Feeds queued tokens to the parser. Error reporting looks at the current
+// token position and line, so these are restored for each of them.
+static void flush_tokens(struct parser_context *ctx)
+{
+	int line = ctx->line;
+	size_t i;
+	for (i = 0; i < ctx->tokens_n && !ctx->failed; i++) {
+		struct lexed_token *lt = &ctx->tokens[i];
+		ctx->lasttoken = lt->tok.type;
+		ctx->ts = lt->ts;
+		ctx->line = lt->line;
+		Parse(ctx->lemon, lt->tok.type, lt->tok, ctx);
+	}
+	ctx->line = line;
+	CLEAR_ARRAY(ctx->tokens);
+}
+
+static void emit_token(struct parser_context *ctx, struct token t, char *ts)
+{
+	// the rest of the input is only scanned after a syntax error
+	if (ctx->failed)
+		return;
+	ctx->ntokens++;
+	if (ctx->batch) {
+		struct lexed_token *lt = &ctx->tokens[ctx->tokens_n++];
+		lt->tok = t;
+		lt->ts = ts;
+		lt->line = ctx->line;
+		if (ctx->tokens_n == TOKEN_BATCH)
+			flush_tokens(ctx);
+		return;
+	}
+	ctx->lasttoken = t.type;
+	ctx->ts = ts;
+	Parse(ctx->lemon, t.type, t, ctx);
+}
+
+#define DEF_T(tt) struct token t; t.type = tt
+static void emit_symbol(struct parser_context *ctx, int tok, char *ts)
+{
+	DEF_T(tok);
+	emit_token(ctx, t, ts);
+}
+
+static void emit_ident(struct parser_context *ctx, char *beg, int len)
+{
+	DEF_T(IDENT);
+	t.sym = intern(beg, len);
+	emit_token(ctx, t, beg);
+}
+
+static void emit_double(struct parser_context *ctx, char *ts, char *te)
+{
+	DEF_T(DOUBLE);
+	t.num = parse_number(ts, te);
+	emit_token(ctx, t, ts);
+}
+
+// Lexes and parses the whole buffer in one go.
+void parse_buffer(struct parser_context *ctx, char *buf, size_t len)
+{
+	int cs, act;
+	char *ts, *te;
+
+	// there is no terminating zero in a mapped file, 'eof' makes the
+	// scanner flush the last token instead
+	char *p = buf;
+	char *pe = buf + len;
+	char *eof = pe;
+	ctx->buf = buf;
+	ctx->end = pe;
+	ctx->base = 0;
+	INIT_ARRAY(ctx->lines, 64);
+	ARRAY_APPEND(ctx->lines, 0);
+	if (ctx->batch)
+		INIT_ARRAY(ctx->tokens, TOKEN_BATCH);
+
+	%% write init;
+	%% write exec;
+
+	flush_tokens(ctx);
+	Parse(ctx->lemon, 0, (struct token){0,0}, ctx);
+	FREE_ARRAY(ctx->tokens);
+	shrink_ast(ctx);
+}
+
+#define STREAM_CHUNK 65536
+
+// Lexes and parses 'fd' as it arrives, STREAM_CHUNK bytes at a time. Scanner
+// state survives between chunks, a token cut in half by a chunk boundary is
+// moved to the beginning of the buffer and completed by the next read. The
+// buffer is reused, but identifiers are interned and don't point into it.
+void parse_stream(struct parser_context *ctx, int fd)
+{
+	int cs, act;
+	char *ts = 0, *te = 0;
+	char *eof = 0;
+
+	size_t alloc = STREAM_CHUNK;
+	size_t have = 0;
+	char *buf = malloc(alloc);
+	ctx->base = 0;
+	INIT_ARRAY(ctx->lines, 64);
+	ARRAY_APPEND(ctx->lines, 0);
+	if (ctx->batch)
+		INIT_ARRAY(ctx->tokens, TOKEN_BATCH);
+
+	%% write init;
+
+	while (!eof) {
+		// a very long token may not fit, grow the buffer then
+		if (alloc - have < STREAM_CHUNK) {
+			alloc = have + STREAM_CHUNK;
+			char *newbuf = realloc(buf, alloc);
+			if (!newbuf) {
+				perror("realloc");
+				ctx->failed = 1;
+				break;
+			}
+			if (ts) {
+				te = newbuf + (te - buf);
+				ts = newbuf;
+			}
+			buf = newbuf;
+		}
+
+		char *p = buf + have;
+		ssize_t n;
+		do {
+			n = read(fd, p, STREAM_CHUNK);
+		} while (n == -1 && errno == EINTR);
+		if (n == -1) {
+			perror("read");
+			n = 0;
+		}
+
+		char *pe = p + n;
+		if (n == 0)
+			eof = pe;
+		ctx->buf = buf;
+		ctx->end = pe;
+		// the buffer may have moved, nothing of this chunk is emitted yet
+		ctx->ts = p;
+
+		%% write exec;
+
+		// queued tokens point into the buffer which is about to change
+		flush_tokens(ctx);
+		if (cs == ancient_error)
+			break;
+
+		if (ts == 0) {
+			ctx->base += pe - buf;
+			have = 0;
+		} else {
+			// carry the partial token over to the next chunk
+			ctx->base += ts - buf;
+			have = pe - ts;
+			memmove(buf, ts, have);
+			te = buf + (te - ts);
+			ts = buf;
+		}
+	}
+
+	// finish parsing while the buffer is still there for error messages,
+	// the last token is the end of input
+	ctx->ts = ctx->end;
+	Parse(ctx->lemon, 0, (struct token){0,0}, ctx);
+	FREE_ARRAY(ctx->tokens);
+	shrink_ast(ctx);
+	free(buf);
+}
@@ -0,0 +1,674 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <readline/readline.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/BitWriter.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/Transforms/Scalar.h>
+#include "grammar.h"
+#include "parser.h"
+#include "source.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Front-end microbenchmark: lexes and parses the source over and over, first
+// calling the parser for each token as it is scanned, then in batch mode.
+static void bench_frontend(struct source *src)
+{
+	static const char *modes[] = {"interleaved", "batched"};
+	int batch;
+	for (batch = 0; batch < 2; batch++) {
+		size_t tokens = 0;
+		int runs = 0;
+		double start = now();
+		double elapsed;
+		do {
+			struct parser_context ctx;
+			init_context(&ctx);
+			ctx.batch = batch;
+			parse_buffer(&ctx, src->buf, src->len);
+			free_context(&ctx);
+			tokens += ctx.ntokens;
+			runs++;
+			elapsed = now() - start;
+		} while (runs < 3 || elapsed < 1.0);
+		printf("%-12s %4d runs, %12.0f tokens/s\n",
+		       modes[batch], runs, tokens / elapsed);
+	}
+}
+
+// One input file, each one is lexed and parsed by its own lemon instance.
+struct parse_job {
+	const char *filename; // 0 means stdin
+	struct source src;
+	struct parser_context ctx;
+	int failed;
+};
+
+struct parse_queue {
+	struct parse_job *jobs;
+	int n;
+	int next;
+	int stream;
+	int cache;
+};
+
+#define CACHE_SUFFIX ".astc"
+
+// Looks for the AST of 'job' in its cache file (next to the source), parses
+// the source and writes the file if it is missing or out of date.
+//
+// A hit saves the scanning and parsing, not the tree: unflatten_ast builds
+// all of it again in the context's arena, with a hash-consing lookup for
+// every shareable node. The passes after parsing need the tree, so with
+// --flat the cached AST goes flat -> tree -> flat (see flatten_bound), the
+// arrays are not handed to codegen_flat as they are.
+static void parse_cached(struct parse_job *job)
+{
+	size_t len = strlen(job->filename);
+	char *path = malloc(len + sizeof(CACHE_SUFFIX));
+	memcpy(path, job->filename, len);
+	memcpy(path + len, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+
+	uint64_t hash = hash_source(job->src.buf, job->src.len);
+	struct flat_ast *fa = load_ast_cache(path, hash, job->src.len);
+	if (fa) {
+		job->ctx.result = unflatten_ast(&job->ctx, fa);
+	} else {
+		parse_buffer(&job->ctx, job->src.buf, job->src.len);
+		if (job->ctx.failed) {
+			free(path);
+			return;
+		}
+		fa = flatten_ast(job->ctx.result);
+		// not being able to write it is fine, it is only a cache
+		save_ast_cache(path, fa, hash, job->src.len);
+	}
+	free_flat_ast(fa);
+	free(path);
+}
+
+static void run_parse_job(struct parse_job *job, int stream, int cache)
+{
+	const char *name = job->filename ? job->filename : "stdin";
+	if (stream) {
+		int fd = 0;
+		if (job->filename && (fd = open(job->filename, O_RDONLY)) == -1) {
+			perror(name);
+			job->failed = 1;
+			return;
+		}
+		parse_stream(&job->ctx, fd);
+		if (job->filename)
+			close(fd);
+		return;
+	}
+
+	// regular files (including redirected stdin) are mapped, not copied
+	int err = job->filename ? source_open(&job->src, job->filename) :
+				  source_read(&job->src, stdin);
+	if (err) {
+		perror(name);
+		job->failed = 1;
+		return;
+	}
+	if (cache && job->filename)
+		parse_cached(job);
+	else
+		parse_buffer(&job->ctx, job->src.buf, job->src.len);
+}
+
+// releases the sources, parse trees and the merged top-level statements
+static void free_program(struct parse_queue *q, struct stmts *top)
+{
+	int i;
+	if (q->n > 1) {
+		FREE_SMALL_ARRAY(top->v);
+		free(top);
+	}
+	for (i = 0; i < q->n; i++) {
+		struct parse_job *job = &q->jobs[i];
+		free_context(&job->ctx);
+		source_close(&job->src);
+	}
+}
+
+static void *parse_worker(void *arg)
+{
+	struct parse_queue *q = arg;
+	for (;;) {
+		int i = __sync_fetch_and_add(&q->next, 1);
+		if (i >= q->n)
+			break;
+		run_parse_job(&q->jobs[i], q->stream, q->cache);
+	}
+	return 0;
+}
+
+static void parse_all(struct parse_queue *q, int nthreads)
+{
+	if (nthreads > q->n)
+		nthreads = q->n;
+	if (nthreads <= 1) {
+		parse_worker(q);
+		return;
+	}
+
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	int i;
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], 0, parse_worker, q);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], 0);
+	free(threads);
+}
+
+static void llvm_wipe_module(LLVMModuleRef m)
+{
+	LLVMValueRef cur = LLVMGetFirstFunction(m);
+	if (!cur)
+		return;
+	for (;;) {
+		LLVMValueRef next = LLVMGetNextFunction(cur);
+		LLVMDeleteFunction(cur);
+		if (!next)
+			break;
+		cur = next;
+	}
+}
+
+// One module of a split program, see codegen_split.
+struct codegen_job {
+	struct binding *b;
+	DECLARE_ARRAY(unsigned, funcs);
+	LLVMContextRef context;
+	LLVMModuleRef module;
+	int index;
+
+	// optimization, see create_passes
+	int level;
+	const char *passes;
+	const char *cpu; // optional, see set_target
+	int failed;
+};
+
+// Targets the module to 'cpu' and gives its data layout to the passes.
+// Returns 0 if the host has no target.
+static int set_target(LLVMModuleRef module, LLVMPassManagerRef pass, const char *cpu)
+{
+	if (!codegen_target(module, cpu))
+		return 0;
+	LLVMAddTargetData(LLVMCreateTargetData(LLVMGetDataLayout(module)), pass);
+	return 1;
+}
+
+static void *codegen_worker(void *arg)
+{
+	struct codegen_job *job = arg;
+	job->context = LLVMContextCreate();
+	job->module = codegen_part(job->context, job->b, job->funcs, job->funcs_n);
+
+	// pass managers are not shared between threads
+	LLVMPassManagerRef pass = create_passes(job->level, job->passes);
+	if (job->cpu && !set_target(job->module, pass, job->cpu))
+		job->failed = 1;
+	LLVMRunPassManager(pass, job->module);
+	LLVMDisposePassManager(pass);
+
+	char name[32];
+	snprintf(name, sizeof(name), "out.%d.bc", job->index);
+	if (LLVMWriteBitcodeToFile(job->module, name)) {
+		fprintf(stderr, "Failed to write %s\n", name);
+		job->failed = 1;
+	}
+	if (job->cpu && !job->failed) {
+		snprintf(name, sizeof(name), "out.%d.s", job->index);
+		if (!codegen_emit(job->module, job->cpu, name))
+			job->failed = 1;
+	}
+	return 0;
+}
+
+// Generates and optimizes the functions of 'b' on up to 'nthreads' threads,
+// each into a module of its own which is written to out.N.bc, and compiled
+// to out.N.s if there's a 'cpu'. Every module declares all functions, the
+// bodies are dealt out in turn. Returns the number of modules, 0 if any of
+// them failed.
+static int codegen_split(struct binding *b, int nthreads, int level, const char *passes,
+			 const char *cpu)
+{
+	size_t i, nbodies = 0;
+	for (i = 0; i < b->funcs_n; i++)
+		nbodies += b->funcs[i]->func.block != 0;
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((size_t)nthreads > nbodies)
+		nthreads = nbodies ? nbodies : 1;
+	if (!compile_init())
+		nthreads = 1;
+
+	struct codegen_job *jobs = calloc(nthreads, sizeof(struct codegen_job));
+	int n = 0;
+	for (i = 0; i < (size_t)nthreads; i++) {
+		jobs[i].b = b;
+		jobs[i].index = i;
+		jobs[i].level = level;
+		jobs[i].passes = passes;
+		jobs[i].cpu = cpu;
+		INIT_ARRAY(jobs[i].funcs, 64);
+	}
+	for (i = 0; i < b->funcs_n; i++) {
+		if (!b->funcs[i]->func.block)
+			continue;
+		struct codegen_job *job = &jobs[n++ % nthreads];
+		ARRAY_APPEND(job->funcs, i);
+	}
+
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	for (n = 0; n < nthreads; n++)
+		pthread_create(&threads[n], 0, codegen_worker, &jobs[n]);
+	for (n = 0; n < nthreads; n++)
+		pthread_join(threads[n], 0);
+	free(threads);
+
+	int ok = 1;
+	for (n = 0; n < nthreads; n++) {
+		ok &= !jobs[n].failed;
+		LLVMDumpModule(jobs[n].module);
+		LLVMDisposeModule(jobs[n].module);
+		LLVMContextDispose(jobs[n].context);
+		FREE_ARRAY(jobs[n].funcs);
+	}
+	free(jobs);
+	return ok ? nthreads : 0;
+}
+
+// Compiles the program once for every CPU of 'list' (comma separated, the
+// baseline first) to out.cloneN.s, and writes the dispatch module, which
+// picks the newest clone the host supports, to out.bc and out.s. Returns
+// the number of clones, 0 on failure.
+static int codegen_clones(struct stmts *top, struct binding *b, const unsigned *roots,
+			  size_t nroots, const char *list, int level, const char *passes)
+{
+	const char **cpus = malloc((strlen(list) + 1) * sizeof(char*));
+	int n = 0, k, ok = 1;
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		if (len)
+			cpus[n++] = strndup(list, len);
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+
+	for (k = 0; k < n && ok; k++) {
+		LLVMContextRef context = LLVMContextCreate();
+		LLVMModuleRef module = codegen(context, top, b);
+		codegen_clone(module, b, roots, nroots, k);
+
+		LLVMPassManagerRef pass = create_passes(level, passes);
+		ok = set_target(module, pass, cpus[k]);
+		if (ok) {
+			char name[32];
+			snprintf(name, sizeof(name), "out.clone%d.s", k);
+			LLVMRunPassManager(pass, module);
+			ok = codegen_emit(module, cpus[k], name);
+		}
+		LLVMDisposePassManager(pass);
+		LLVMDisposeModule(module);
+		LLVMContextDispose(context);
+	}
+
+	if (ok && n) {
+		LLVMContextRef context = LLVMContextCreate();
+		LLVMModuleRef module = codegen_dispatch(context, b, roots, nroots, cpus, n);
+		ok = codegen_target(module, cpus[0]);
+		if (ok) {
+			LLVMDumpModule(module);
+			LLVMWriteBitcodeToFile(module, "out.bc");
+			ok = codegen_emit(module, cpus[0], "out.s");
+		}
+		LLVMDisposeModule(module);
+		LLVMContextDispose(context);
+	}
+
+	for (k = 0; k < n; k++)
+		free((char*)cpus[k]);
+	free(cpus);
+	return ok ? n : 0;
+}
+
+// Reports the first CPU of 'list' (comma separated) a clone can't be
+// compiled for, see codegen_cpu_features, or a list without any CPU.
+// Returns 0 if there's none.
+static int check_clones(const char *list)
+{
+	int n = 0;
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		char *cpu = strndup(list, len);
+		int known = !len || codegen_cpu_features(cpu);
+		if (!known)
+			fprintf(stderr, "Unknown CPU for --clones: %s\n", cpu);
+		free(cpu);
+		if (!known)
+			return -1;
+		n += len != 0;
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	if (!n) {
+		fprintf(stderr, "--clones needs at least one CPU\n");
+		return -1;
+	}
+	return 0;
+}
+
+static unsigned intern_string(const char *s)
+{
+	return intern(s, strlen(s));
+}
+
+int main(int argc, char **argv)
+{
+	int stream = 0;
+	int batch = 0;
+	int bench = 0;
+	int stats = 0;
+	int flat = 0;
+	int cache = 0;
+	int split = 0;
+	int fast_math = 0;
+	int level = 1;
+	const char *passes = 0;
+	const char *cpu = 0;
+	const char *clones = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char **files = malloc(argc * sizeof(char*));
+	int nfiles = 0;
+	// functions kept even if main doesn't use them
+	unsigned *roots = malloc(argc * sizeof(unsigned));
+	size_t nroots = 0;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--stream") == 0)
+			stream = 1;
+		else if (strcmp(argv[i], "--batch") == 0)
+			batch = 1;
+		else if (strcmp(argv[i], "--bench") == 0)
+			bench = 1;
+		else if (strcmp(argv[i], "--stats") == 0)
+			stats = 1;
+		else if (strcmp(argv[i], "--flat") == 0)
+			flat = 1;
+		else if (strcmp(argv[i], "--cache") == 0)
+			cache = 1;
+		else if (strcmp(argv[i], "--split") == 0)
+			split = 1;
+		else if (strcmp(argv[i], "--fast-math") == 0)
+			fast_math = 1;
+		else if (strncmp(argv[i], "--passes=", 9) == 0)
+			passes = argv[i] + 9;
+		else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2]) {
+			// a single digit, -Os and the like are not supported
+			const char *l = argv[i] + 2;
+			if (l[0] < '0' || l[0] > '3' || l[1]) {
+				fprintf(stderr, "Unknown optimization level: %s\n", argv[i]);
+				return 1;
+			}
+			level = l[0] - '0';
+		}
+		else if (strcmp(argv[i], "-march=native") == 0)
+			cpu = "native";
+		else if (strncmp(argv[i], "-march=", 7) == 0) {
+			fprintf(stderr, "Only the native architecture is supported: %s\n", argv[i]);
+			return 1;
+		}
+		else if (strncmp(argv[i], "-mcpu=", 6) == 0 && argv[i][6])
+			cpu = argv[i] + 6;
+		else if (strncmp(argv[i], "--clones=", 9) == 0) {
+			clones = argv[i] + 9;
+			if (check_clones(clones))
+				return 1;
+		}
+		else if (strcmp(argv[i], "--export") == 0 && i+1 < argc)
+			roots[nroots++] = intern_string(argv[++i]);
+		else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2])
+			nthreads = atoi(argv[i] + 2);
+		else if (strcmp(argv[i], "-j") == 0 && i+1 < argc)
+			nthreads = atoi(argv[++i]);
+		else
+			files[nfiles++] = argv[i];
+	}
+
+	if (split && flat) {
+		fprintf(stderr, "--split needs the tree AST, it can't be used with --flat\n");
+		return 1;
+	}
+	if (clones && flat) {
+		fprintf(stderr, "--clones needs the tree AST, it can't be used with --flat\n");
+		return 1;
+	}
+
+	LLVMInitializeNativeTarget();
+	codegen_init_target();
+
+	// a custom list of passes replaces the ones of the -O level, it is
+	// checked before anything is parsed; each module gets a pass manager of
+	// its own later
+	LLVMPassManagerRef pass = create_passes(level, passes);
+	if (!pass)
+		return 1;
+	LLVMDisposePassManager(pass);
+
+#if 1
+	if (bench) {
+		struct source src;
+		const char *filename = nfiles ? files[0] : 0;
+		int err = filename ? source_open(&src, filename) : source_read(&src, stdin);
+		if (err) {
+			perror(filename ? filename : "stdin");
+			return 1;
+		}
+		bench_frontend(&src);
+		source_close(&src);
+		return 0;
+	}
+
+	// no files means stdin
+	struct parse_queue queue = {0, nfiles ? nfiles : 1, 0, stream, cache};
+	queue.jobs = calloc(queue.n, sizeof(struct parse_job));
+	for (i = 0; i < queue.n; i++) {
+		struct parse_job *job = &queue.jobs[i];
+		job->filename = nfiles ? files[i] : 0;
+		init_context(&job->ctx);
+		job->ctx.batch = batch;
+		job->ctx.filename = job->filename;
+	}
+	parse_all(&queue, nthreads);
+
+	// top-level statements of all files go into a single program
+	struct stmts *top = queue.jobs[0].ctx.result;
+	if (queue.n > 1) {
+		top = malloc(sizeof(struct stmts));
+		INIT_SMALL_ARRAY(top->v);
+	}
+	for (i = 0; i < queue.n; i++) {
+		struct parse_job *job = &queue.jobs[i];
+		if (job->failed || job->ctx.failed)
+			return 1;
+		if (queue.n > 1) {
+			size_t j;
+			struct stmts *ss = job->ctx.result;
+			for (j = 0; j < ss->v_n; j++)
+				SMALL_ARRAY_APPEND(top->v, ss->v[j]);
+		}
+	}
+
+	if (stats) {
+		size_t nodes = 0, bytes = 0;
+		for (i = 0; i < queue.n; i++) {
+			nodes += queue.jobs[i].ctx.nodes;
+			bytes += queue.jobs[i].ctx.arena.bytes;
+		}
+		fprintf(stderr, "AST: %zu nodes, %zu bytes\n", nodes, bytes);
+	}
+
+	roots[nroots++] = intern_string("main");
+	size_t pruned = prune_functions(top, roots, nroots);
+	if (stats)
+		fprintf(stderr, "reach: %zu unused functions removed\n", pruned);
+
+	size_t folded = fold_ast(top, fast_math);
+	if (stats)
+		fprintf(stderr, "fold: %zu nodes removed\n", folded);
+
+	// names are resolved and checked before any LLVM work
+	struct binding binding;
+	if (bind_ast(&binding, top))
+		return 1;
+
+	size_t ints = infer_types(&binding, roots, nroots);
+	if (stats)
+		fprintf(stderr, "types: %zu integer variables\n", ints);
+
+	// the flat AST carries the binding and the types, it doesn't refer to
+	// the source, the parse tree or the binder, all are released before
+	// codegen then
+	struct flat_ast *fa = 0;
+	if (flat) {
+		fa = flatten_bound(top, &binding);
+		if (stats)
+			fprintf(stderr, "flat AST: %zu nodes, %zu bytes\n",
+				fa->n, flat_ast_bytes(fa));
+		free_program(&queue, top);
+		free_binding(&binding);
+	}
+
+	// one build of the program for every CPU, instead of -march and --split
+	if (clones) {
+		print_ast(top);
+		int nclones = codegen_clones(top, &binding, roots, nroots, clones,
+					     level, passes);
+		if (stats)
+			fprintf(stderr, "clones: %d\n", nclones);
+		free_program(&queue, top);
+		free_binding(&binding);
+		free(queue.jobs);
+		free(roots);
+		free(files);
+		return nclones ? 0 : 1;
+	}
+
+	// functions are generated and optimized in parallel, one module for
+	// each thread
+	if (split) {
+		print_ast(top);
+		int nmods = codegen_split(&binding, nthreads, level, passes, cpu);
+		if (stats)
+			fprintf(stderr, "split: %d modules\n", nmods);
+		free_program(&queue, top);
+		free_binding(&binding);
+		free(queue.jobs);
+		free(roots);
+		free(files);
+		return nmods ? 0 : 1;
+	}
+
+	LLVMContextRef llctx = LLVMContextCreate();
+	LLVMModuleRef llmod;
+	if (flat) {
+		print_flat_ast(fa);
+		llmod = codegen_flat(llctx, fa);
+	} else {
+		print_ast(top);
+		llmod = codegen(llctx, top, &binding);
+	}
+	pass = create_passes(level, passes);
+	int ok = !cpu || set_target(llmod, pass, cpu);
+	if (ok) {
+		LLVMRunPassManager(pass, llmod);
+		LLVMDumpModule(llmod);
+		LLVMWriteBitcodeToFile(llmod, "out.bc");
+		ok = !cpu || codegen_emit(llmod, cpu, "out.s");
+	}
+	LLVMDisposePassManager(pass);
+	LLVMDisposeModule(llmod);
+	LLVMContextDispose(llctx);
+
+	if (flat) {
+		free_flat_ast(fa);
+	} else {
+		free_program(&queue, top);
+		free_binding(&binding);
+	}
+	free(queue.jobs);
+	free(roots);
+	free(files);
+	if (!ok)
+		return 1;
+#else
+	// prompt
+	for (;;) {
+		char *line = readline("> ");
+		if (!line)
+			break;
+		if (!*line) {
+			free(line);
+			continue;
+		}
+		if (strcmp("exit", line) == 0) 
+			break;
+		add_history(line);
+
+		char *p = line;
+		char *pe = line + strlen(line) + 1;
+
+		%% write exec;
+	
+		Parse(lemon.lemon, 0, (struct token){0, 0}, &lemon);
+		struct codegen_context ctx = {0, llmod};
+		codegen(&ctx, lemon.result);
+
+		//LLVMRunPassManager(pass, llmod);
+
+		printf("-----------------------------------------\n");
+		LLVMDumpModule(llmod);
+		printf("-----------------------------------------\n");
+
+		LLVMVerifyModule(llmod, LLVMAbortProcessAction, &error);
+
+		LLVMValueRef llmain = LLVMGetNamedFunction(llmod, "main");
+		if (!llmain) {
+			printf("No 'main' function!\n");
+		} else {
+			double (*FP)() = LLVMGetPointerToGlobal(engine, llmain);
+			printf("Result: %f\n", (*FP)());
+		}
+	
+		// reset
+		llvm_wipe_module(llmod);
+
+		free(line);
+	}
+
+	ParseFree(lemon.lemon, free);
+#endif
+
+	return 0;
+}
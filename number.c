@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "parser.h"
+
+// Numeric literals are converted straight from the source buffer. Integers
+// that fit into 64 bits and decimals with a 53 bit significand and a small
+// exponent are exact after a single rounding (Clinger's fast path), everything
+// else goes to strtod.
+
+#define MAX_DIGITS 19
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+
+static const double exact_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+#define MAX_EXACT_POW10 22
+
+static double parse_number_slow(const char *beg, const char *end)
+{
+	char tmpbuf[512];
+	size_t len = end - beg;
+	char *buf = len < sizeof(tmpbuf) ? tmpbuf : malloc(len + 1);
+	memcpy(buf, beg, len);
+	buf[len] = '\0';
+
+	double num = strtod(buf, 0);
+	if (buf != tmpbuf)
+		free(buf);
+	return num;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	return (c | 0x20) - 'a' + 10;
+}
+
+static double parse_hex(const char *beg, const char *end)
+{
+	const char *p = beg + 2;
+	uint64_t mant = 0;
+
+	while (p < end && *p == '0')
+		p++;
+	if (end - p > 16)
+		return parse_number_slow(beg, end);
+	for (; p < end; p++)
+		mant = (mant << 4) | hexval(*p);
+	return (double)mant;
+}
+
+double parse_number(const char *beg, const char *end)
+{
+	const char *p = beg;
+	uint64_t mant = 0;
+	int ndigits = 0;
+	int exp10 = 0;
+	int inexact = 0;
+
+	if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x')
+		return parse_hex(beg, end);
+
+	// integer part
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		int d = *p - '0';
+		if (ndigits < MAX_DIGITS) {
+			mant = mant * 10 + d;
+			if (mant)
+				ndigits++;
+		} else {
+			exp10++;
+			inexact |= d;
+		}
+	}
+
+	// integer fast path, uint64 -> double conversion is correctly rounded
+	if (p == end && !inexact && exp10 == 0)
+		return (double)mant;
+
+	// fraction
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			int d = *p - '0';
+			if (ndigits < MAX_DIGITS) {
+				mant = mant * 10 + d;
+				if (mant)
+					ndigits++;
+				exp10--;
+			} else {
+				inexact |= d;
+			}
+		}
+	}
+
+	// exponent
+	if (p < end && (*p | 0x20) == 'e') {
+		int neg = 0;
+		int e = 0;
+		p++;
+		if (*p == '+' || *p == '-')
+			neg = *p++ == '-';
+		for (; p < end; p++) {
+			if (e < 100000)
+				e = e * 10 + (*p - '0');
+		}
+		exp10 += neg ? -e : e;
+	}
+
+	if (inexact || mant > MAX_EXACT_MANTISSA)
+		return parse_number_slow(beg, end);
+	if (mant == 0)
+		return 0.0;
+	if (exp10 == 0)
+		return (double)mant;
+	if (exp10 < 0 && exp10 >= -MAX_EXACT_POW10)
+		return (double)mant / exact_pow10[-exp10];
+	if (exp10 > 0 && exp10 <= MAX_EXACT_POW10)
+		return (double)mant * exact_pow10[exp10];
+	return parse_number_slow(beg, end);
+}
@@ -3,6 +3,8 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <ctype.h>
+#include <string.h>
+#include <stdint.h>
 #include "parser.h"
 #include "grammar.h"
 
@@ -42,24 +44,78 @@ const char *tokname(int token)
 	return toknames[token];
 }
 
+//-------------------------------------------------------------------------
+// Line index, lines[i] is the offset of line i+1 from the start of the input
+//-------------------------------------------------------------------------
+
+size_t line_offset(struct parser_context *ctx, int line)
+{
+	if (line < 1 || line > ctx->lines_n)
+		return (size_t)-1;
+	return ctx->lines[line-1];
+}
+
+int offset_line(struct parser_context *ctx, size_t offset)
+{
+	size_t lo = 0, hi = ctx->lines_n;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (ctx->lines[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo + 1;
+}
+
+// at most that many characters around the error are printed
+#define ERROR_CONTEXT 80
+
 void print_syntax_error(struct parser_context *ctx, const char *msg, ...)
 {
-	char *beg = ctx->buf;
-	if (ctx->line != 1) {
-		char *iter = ctx->ts;
-		while (*iter != '\n')
-			iter--;
-		beg = iter+1;
+	// the source buffer is not null-terminated, stay within [buf, end)
+	char *pos = ctx->ts ? ctx->ts : ctx->buf;
+	if (pos < ctx->buf)
+		pos = ctx->buf;
+	if (pos > ctx->end)
+		pos = ctx->end;
+	size_t offset = ctx->base + (pos - ctx->buf);
+
+	// current line is right most of the time, fall back to a search
+	int line = ctx->line;
+	size_t lbeg = line_offset(ctx, line);
+	size_t lend = line_offset(ctx, line+1);
+	if (lbeg == (size_t)-1 || offset < lbeg || offset >= lend) {
+		line = offset_line(ctx, offset);
+		lbeg = line_offset(ctx, line);
+		lend = line_offset(ctx, line+1);
 	}
-	char *end = strchr(beg, '\n');
+
+	// the streaming lexer may not have the whole line in memory
+	char *beg = ctx->buf;
+	char *end = ctx->end;
+	if (lbeg >= ctx->base)
+		beg = ctx->buf + (lbeg - ctx->base);
+	if (lend != (size_t)-1 && lend - 1 - ctx->base < (size_t)(end - ctx->buf))
+		end = ctx->buf + (lend - 1 - ctx->base);
+	if (beg > pos)
+		beg = pos;
+	if (end < pos)
+		end = pos;
+	if (pos - beg > ERROR_CONTEXT)
+		beg = pos - ERROR_CONTEXT;
+	if (end - pos > ERROR_CONTEXT)
+		end = pos + ERROR_CONTEXT;
+	char *nl = memchr(pos, '\n', end - pos);
+	if (nl)
+		end = nl;
+
 	// print string with an error
-	if (end)
-		fwrite(beg, 1, end-beg+1, stderr);
-	else
-		fprintf(stderr, "%s\n", beg);
+	fwrite(beg, 1, end-beg, stderr);
+	fputc('\n', stderr);
 	// print error pointer
 	int i;
-	for (i = 0; i < ctx->ts - beg; i++) {
+	for (i = 0; i < pos - beg; i++) {
 		if (isspace(beg[i]))
 			fputc(beg[i], stderr);
 		else
@@ -67,6 +123,8 @@ void print_syntax_error(struct parser_context *ctx, const char *msg, ...)
 	}
 	fputs("\033[1;31m^\033[0m\n", stderr);
 	// print error message
+	if (ctx->filename)
+		fprintf(stderr, "%s: ", ctx->filename);
 	va_list args;
 	va_start(args, msg);
 	vfprintf(stderr, msg, args);
@@ -74,32 +132,144 @@ void print_syntax_error(struct parser_context *ctx, const char *msg, ...)
 	va_end(args);
 }
 
-#define DEF_E(tt) struct expr *e = malloc(sizeof(struct expr)); e->type = tt
-struct expr *new_num_expr(double num)
+//-------------------------------------------------------------------------
+// Hash-consing. Numbers, identifiers and binary expressions over those are
+// pure, structurally equal ones are built once per function and shared.
+// Children are consed before their parents, so comparing them by pointer is
+// enough. Functions don't share nodes, the table is reset after each one.
+//-------------------------------------------------------------------------
+
+static size_t hash_expr(struct expr *e)
+{
+	uint64_t h = e->type;
+	uint64_t bits;
+	switch (e->type) {
+	case EXPR_NUM:
+		memcpy(&bits, &e->num, sizeof(bits));
+		h ^= bits;
+		break;
+	case EXPR_BIN:
+		h ^= (uint64_t)e->bin.tok << 8;
+		h = (h ^ (uintptr_t)e->bin.lhs) * 0x9e3779b97f4a7c15ULL;
+		h ^= (uintptr_t)e->bin.rhs;
+		break;
+	case EXPR_IDENT:
+		h ^= (uint64_t)e->ident.sym << 8;
+		break;
+	default:
+		break;
+	}
+	h *= 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+static int same_expr(struct expr *a, struct expr *b)
+{
+	if (a->type != b->type)
+		return 0;
+	switch (a->type) {
+	case EXPR_NUM:
+		// bitwise, 0.0 and -0.0 are different constants
+		return memcmp(&a->num, &b->num, sizeof(a->num)) == 0;
+	case EXPR_BIN:
+		return a->bin.tok == b->bin.tok && a->bin.lhs == b->bin.lhs &&
+		       a->bin.rhs == b->bin.rhs;
+	case EXPR_IDENT:
+		return a->ident.sym == b->ident.sym;
+	default:
+		return 0;
+	}
+}
+
+static void grow_cons(struct parser_context *ctx)
 {
-	DEF_E(EXPR_NUM);
-	e->num = num;
+	struct cons_slot *old = ctx->cons;
+	size_t oldalloc = ctx->cons_alloc;
+	size_t i;
+
+	ctx->cons_alloc = oldalloc ? oldalloc * 2 : 256;
+	ctx->cons = calloc(ctx->cons_alloc, sizeof(struct cons_slot));
+	for (i = 0; i < oldalloc; i++) {
+		if (!old[i].e || old[i].gen != ctx->cons_gen)
+			continue;
+		size_t j = hash_expr(old[i].e) & (ctx->cons_alloc - 1);
+		while (ctx->cons[j].e)
+			j = (j + 1) & (ctx->cons_alloc - 1);
+		ctx->cons[j] = old[i];
+	}
+	free(old);
+}
+
+// returns the shared copy of 'key', allocating it if it's the first one
+static struct expr *cons_expr(struct parser_context *ctx, struct expr *key)
+{
+	if ((ctx->cons_n + 1) * 2 > ctx->cons_alloc)
+		grow_cons(ctx);
+
+	size_t mask = ctx->cons_alloc - 1;
+	size_t i = hash_expr(key) & mask;
+	for (;; i = (i + 1) & mask) {
+		struct cons_slot *s = &ctx->cons[i];
+		if (!s->e || s->gen != ctx->cons_gen)
+			break;
+		if (same_expr(s->e, key))
+			return s->e;
+	}
+
+	struct expr *e = arena_alloc(&ctx->arena, sizeof(struct expr));
+	ctx->nodes++;
+	*e = *key;
+	e->consed = 1;
+	ctx->cons[i].e = e;
+	ctx->cons[i].gen = ctx->cons_gen;
+	ctx->cons_n++;
 	return e;
 }
 
-struct expr *new_binary_expr(int tok, struct expr *lhs, struct expr *rhs)
+static void end_cons_scope(struct parser_context *ctx)
+{
+	ctx->cons_gen++;
+	ctx->cons_n = 0;
+}
+
+static void free_cons(struct parser_context *ctx)
+{
+	free(ctx->cons);
+	ctx->cons = 0;
+	ctx->cons_n = ctx->cons_alloc = 0;
+}
+
+#define DEF_E(tt) struct expr *e = arena_alloc(&ctx->arena, sizeof(struct expr)); ctx->nodes++; e->type = tt; e->consed = 0; e->wide = 0
+struct expr *new_num_expr(struct parser_context *ctx, double num)
+{
+	struct expr key = {EXPR_NUM};
+	key.num = num;
+	return cons_expr(ctx, &key);
+}
+
+// binary expressions with calls inside are never shared
+struct expr *new_binary_expr(struct parser_context *ctx, int tok, struct expr *lhs, struct expr *rhs)
 {
+	struct expr key = {EXPR_BIN};
+	key.bin.tok = tok;
+	key.bin.lhs = lhs;
+	key.bin.rhs = rhs;
+	if (lhs->consed && rhs->consed)
+		return cons_expr(ctx, &key);
+
 	DEF_E(EXPR_BIN);
-	e->bin.tok = tok;
-	e->bin.lhs = lhs;
-	e->bin.rhs = rhs;
+	e->bin = key.bin;
 	return e;
 }
 
-struct expr *new_ident_expr(char *beg, int len)
+struct expr *new_ident_expr(struct parser_context *ctx, unsigned sym)
 {
-	DEF_E(EXPR_IDENT);
-	e->ident.beg = beg;
-	e->ident.len = len;
-	return e;
+	struct expr key = {EXPR_IDENT};
+	key.ident.sym = sym;
+	return cons_expr(ctx, &key);
 }
 
-struct expr *new_call_expr(struct expr *ident, struct args *args)
+struct expr *new_call_expr(struct parser_context *ctx, struct expr *ident, struct args *args)
 {
 	DEF_E(EXPR_CALL);
 	e->call.ident = ident;
@@ -108,28 +278,28 @@ struct expr *new_call_expr(struct expr *ident, struct args *args)
 }
 #undef DEF_E
 
-#define DEF_S(tt) struct stmt *s = malloc(sizeof(struct stmt)); s->type = tt
-struct stmt *new_expr_stmt(struct expr *e)
+#define DEF_S(tt) struct stmt *s = arena_alloc(&ctx->arena, sizeof(struct stmt)); ctx->nodes++; s->type = tt
+struct stmt *new_expr_stmt(struct parser_context *ctx, struct expr *e)
 {
 	DEF_S(STMT_EXPR);
 	s->expr = e;
 	return s;
 }
 
-struct stmt *new_assign_stmt(struct expr *ident, struct expr *rhs)
+struct stmt *new_assign_stmt(struct parser_context *ctx, struct expr *ident, struct expr *rhs)
 {
 	DEF_S(STMT_ASSIGN);
 	s->assign.ident = ident;
 	s->assign.rhs = rhs;
 	return s;
 }
-struct stmt *new_block_stmt(struct stmts *block)
+struct stmt *new_block_stmt(struct parser_context *ctx, struct stmts *block)
 {
 	DEF_S(STMT_BLOCK);
 	s->block = block;
 	return s;
 }
-struct stmt *new_ifelse_stmt(struct expr *cond, struct stmt *b1, struct stmt *b2)
+struct stmt *new_ifelse_stmt(struct parser_context *ctx, struct expr *cond, struct stmt *b1, struct stmt *b2)
 {
 	DEF_S(STMT_IFELSE);
 	s->ifelse.cond = cond;
@@ -138,7 +308,7 @@ struct stmt *new_ifelse_stmt(struct expr *cond, struct stmt *b1, struct stmt *b2
 	return s;
 }
 
-struct stmt *new_for_stmt(struct expr *cond, struct stmt *block)
+struct stmt *new_for_stmt(struct parser_context *ctx, struct expr *cond, struct stmt *block)
 {
 	DEF_S(STMT_FOR);
 	s->forloop.cond = cond;
@@ -146,16 +316,33 @@ struct stmt *new_for_stmt(struct expr *cond, struct stmt *block)
 	return s;
 }
 
-struct stmt *new_func_stmt(struct expr *ident, struct args *args, struct stmt *b)
+struct stmt *new_func_stmt(struct parser_context *ctx, struct expr *ident, struct args *args, struct stmt *b)
 {
 	DEF_S(STMT_FUNC);
+	end_cons_scope(ctx);
 	s->func.ident = ident;
 	s->func.args = args;
+	s->func.nslots = 0;
+	s->func.fast = 0;
+	s->func.rettype = TYPE_DOUBLE;
+	s->func.types = 0;
 	s->func.block = b;
 	return s;
 }
 
-struct stmt *new_var_stmt(struct expr *ident, struct expr *init)
+// 'sym' is an ident right before func, returns 1 if it is 'fast'
+int func_modifier(struct parser_context *ctx, unsigned sym)
+{
+	if (strcmp(sym_name(sym), "fast") == 0)
+		return 1;
+	if (!ctx->failed)
+		print_syntax_error(ctx, "Unknown modifier '%s' of func on line: %d",
+				   sym_name(sym), ctx->line);
+	ctx->failed = 1;
+	return 0;
+}
+
+struct stmt *new_var_stmt(struct parser_context *ctx, struct expr *ident, struct expr *init)
 {
 	DEF_S(STMT_VAR);
 	s->var.ident = ident;
@@ -163,7 +350,7 @@ struct stmt *new_var_stmt(struct expr *ident, struct expr *init)
 	return s;
 }
 
-struct stmt *new_return_stmt(struct expr *e)
+struct stmt *new_return_stmt(struct parser_context *ctx, struct expr *e)
 {
 	DEF_S(STMT_RETURN);
 	s->ret = e;
@@ -171,22 +358,63 @@ struct stmt *new_return_stmt(struct expr *e)
 }
 #undef DEF_S
 
-struct stmts *new_stmts(struct stmt *s)
+struct stmts *new_stmts(struct parser_context *ctx, struct stmt *s)
 {
-	struct stmts *ss = malloc(sizeof(struct stmts));
-	INIT_ARRAY(ss->v, 4);
-	ARRAY_APPEND(ss->v, s);
+	struct stmts *ss = arena_alloc(&ctx->arena, sizeof(struct stmts));
+	ctx->nodes++;
+	INIT_SMALL_ARRAY(ss->v);
+	ss->v[ss->v_n++] = s;
 	return ss;
 }
 
-struct args *new_args(struct expr *e)
+struct args *new_args(struct parser_context *ctx, struct expr *e)
 {
-	struct args *aa = malloc(sizeof(struct args));
-	INIT_ARRAY(aa->v, 4);
-	ARRAY_APPEND(aa->v, e);
+	struct args *aa = arena_alloc(&ctx->arena, sizeof(struct args));
+	ctx->nodes++;
+	INIT_SMALL_ARRAY(aa->v);
+	aa->v[aa->v_n++] = e;
 	return aa;
 }
 
+// lists which go to the heap are remembered, to be shrunk and freed later
+void append_stmt(struct parser_context *ctx, struct stmts *ss, struct stmt *s)
+{
+	if (SMALL_ARRAY_IS_INLINE(ss->v) && ss->v_n == STMTS_INLINE)
+		ARRAY_APPEND(ctx->spilled_stmts, ss);
+	SMALL_ARRAY_APPEND(ss->v, s);
+}
+
+void append_arg(struct parser_context *ctx, struct args *aa, struct expr *e)
+{
+	if (SMALL_ARRAY_IS_INLINE(aa->v) && aa->v_n == ARGS_INLINE)
+		ARRAY_APPEND(ctx->spilled_args, aa);
+	SMALL_ARRAY_APPEND(aa->v, e);
+}
+
+// trims heap allocated lists to size once parsing is done
+void shrink_ast(struct parser_context *ctx)
+{
+	size_t i;
+	free_cons(ctx);
+	for (i = 0; i < ctx->spilled_stmts_n; i++)
+		SHRINK_ARRAY(ctx->spilled_stmts[i]->v);
+	for (i = 0; i < ctx->spilled_args_n; i++)
+		SHRINK_ARRAY(ctx->spilled_args[i]->v);
+}
+
+void free_ast(struct parser_context *ctx)
+{
+	size_t i;
+	for (i = 0; i < ctx->spilled_stmts_n; i++)
+		FREE_SMALL_ARRAY(ctx->spilled_stmts[i]->v);
+	for (i = 0; i < ctx->spilled_args_n; i++)
+		FREE_SMALL_ARRAY(ctx->spilled_args[i]->v);
+	FREE_ARRAY(ctx->spilled_stmts);
+	FREE_ARRAY(ctx->spilled_args);
+	free_cons(ctx);
+	arena_free(&ctx->arena);
+}
+
 //-------------------------------------------------------------------------
 // AST printing
 //-------------------------------------------------------------------------
@@ -213,14 +441,10 @@ static void print_expr_r(int indent, struct expr *e)
 		print_expr_r(indent+1, e->bin.rhs);
 		break;
 	case EXPR_IDENT:
-		printf("IDENT: ");
-		fwrite(e->ident.beg, 1, e->ident.len, stdout);
-		printf("\n");
+		printf("IDENT: %s\n", sym_name(e->ident.sym));
 		break;
 	case EXPR_CALL:
-		printf("CALL: ");
-		fwrite(e->call.ident->ident.beg, 1, e->call.ident->ident.len, stdout);
-		printf("\n");
+		printf("CALL: %s\n", sym_name(e->call.ident->ident.sym));
 		print_call_args(indent+1, e->call.args);
 		break;
 	}
@@ -271,7 +495,9 @@ static void print_for_stmt(int indent, struct stmt *s)
 static void print_func_stmt(int indent, struct stmt *s)
 {
 	print_indent(indent);
-	if (s->func.block)
+	if (s->func.block && s->func.fast)
+		printf("FAST FUNC\n");
+	else if (s->func.block)
 		printf("FUNC\n");
 	else
 		printf("FOREIGN FUNC\n");
@@ -344,3 +570,72 @@ void print_ast(struct stmts *top)
 {
 	print_block_stmt(0, top);
 }
+
+void print_flat_ast(struct flat_ast *fa)
+{
+	// subtrees we're in, the depth is the indentation
+	DECLARE_ARRAY(unsigned, parents);
+	INIT_ARRAY(parents, 16);
+
+	unsigned i;
+	for (i = 0; i < fa->n; i++) {
+		while (parents_n && fa->next[parents[parents_n-1]] <= i)
+			parents_n--;
+
+		int indent = parents_n;
+		if (indent) {
+			// else block is the one after the cond and the true block
+			unsigned parent = parents[parents_n-1];
+			if (fa->kind[parent] == FLAT_IFELSE && i == fa->next[fa->next[parent+1]]) {
+				print_indent(indent-1);
+				printf("ELSE\n");
+			}
+		}
+
+		print_indent(indent);
+		switch (fa->kind[i]) {
+		case FLAT_NUM:
+			printf("NUMBER: %f\n", fa->nums[fa->data[i]]);
+			break;
+		case FLAT_BIN:
+			printf("BINARY: %c\n", tokchars[fa->data[i]]);
+			break;
+		case FLAT_IDENT:
+			printf("IDENT: %s\n", sym_name(fa->data[i]));
+			break;
+		case FLAT_CALL:
+			printf("CALL: %s\n", sym_name(fa->data[i]));
+			break;
+		case FLAT_ASSIGN:
+			printf("ASSIGN STMT\n");
+			break;
+		case FLAT_BLOCK:
+			printf("BLOCK\n");
+			break;
+		case FLAT_IFELSE:
+			printf("IF\n");
+			break;
+		case FLAT_FOR:
+			printf("FOR\n");
+			break;
+		case FLAT_FUNC:
+			if (flat_func_has_body(fa, i) && (fa->data[i] & FLAT_FAST))
+				printf("FAST FUNC\n");
+			else if (flat_func_has_body(fa, i))
+				printf("FUNC\n");
+			else
+				printf("FOREIGN FUNC\n");
+			break;
+		case FLAT_VAR:
+			printf("VAR\n");
+			break;
+		case FLAT_RETURN:
+			printf("RETURN\n");
+			break;
+		}
+
+		if (fa->next[i] > i + 1)
+			ARRAY_APPEND(parents, i);
+	}
+	FREE_ARRAY(parents);
+}
@@ -1,28 +1,40 @@
 #pragma once
 
+#include <stdint.h>
+#include <math.h>
 #include <llvm-c/Core.h>
 #include "array.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 const char *tokname(int token);
+double parse_number(const char *beg, const char *end);
+
+// identifiers are interned by the lexer, see symtab.c
+unsigned intern(const char *beg, int len);
+const char *sym_name(unsigned sym);
+int sym_len(unsigned sym);
+unsigned sym_count(void);
 
 struct token {
 	int type; // for types see grammar.h, it is generated by lemon
 	union {
 		double num;
-		struct {
-			char *beg;
-			int len;
-		} ident;
+		unsigned sym;
 	};
 };
 
 struct expr;
 
+// most argument lists and blocks are tiny, these fit without a heap
+// allocation, see DECLARE_SMALL_ARRAY
+#define ARGS_INLINE 3
+#define STMTS_INLINE 4
+
 struct args {
-	DECLARE_ARRAY(struct expr*, v);
+	DECLARE_SMALL_ARRAY(struct expr*, v, ARGS_INLINE);
 };
 
 enum expr_type {
@@ -32,8 +44,21 @@ enum expr_type {
 	EXPR_CALL,
 };
 
+// filled in by the binder, see bind.c
+enum bind_kind {
+	BIND_NONE,
+	BIND_LOCAL, // index: variable slot in the function
+	BIND_FUNC,  // index: into the function table
+};
+
 struct expr {
 	enum expr_type type;
+	// set if the node is hash-consed and may have several parents, see
+	// new_binary_expr
+	unsigned char consed;
+	// set by infer_types on a + - * of integers whose result is not proven
+	// to stay under 2^53, it is computed in doubles
+	unsigned char wide;
 	union {
 		double num;
 		struct {
@@ -42,8 +67,9 @@ struct expr {
 			struct expr *rhs;
 		} bin;
 		struct {
-			char *beg;
-			int len;
+			unsigned sym;
+			enum bind_kind bind;
+			unsigned index;
 		} ident;
 		struct {
 			struct expr *ident;
@@ -52,6 +78,19 @@ struct expr {
 	};
 };
 
+// value types, joining two of them gives the larger one
+enum value_type {
+	TYPE_INT,    // 64-bit integer
+	TYPE_DOUBLE,
+};
+
+// numbers typed as integers, the ones a double holds exactly
+static inline int num_is_int(double num)
+{
+	return num > -9007199254740992.0 && num < 9007199254740992.0 &&
+	       num == (double)(int64_t)num && !(num == 0 && signbit(num));
+}
+
 enum stmt_type {
 	STMT_EXPR,
 	STMT_ASSIGN,
@@ -90,6 +129,19 @@ struct stmt {
 			// by convention if there are no block, this AST node
 			// means foreign function declaration
 			struct stmt *block;
+
+			// number of variable slots, arguments included
+			unsigned nslots;
+
+			// fast-math: x / c as x * 1/c, (x op c1) op c2 with the
+			// constants folded, x + 0 and x - x dropped (see fold.c
+			// and codegen_binop). Reductions over a loop are not
+			// reassociated.
+			int fast;
+
+			// set by infer_types, all doubles until then
+			enum value_type rettype;
+			enum value_type *types; // of the slots, optional
 		} func;
 		struct {
 			struct expr *ident;
@@ -100,42 +152,237 @@ struct stmt {
 };
 
 struct stmts {
-	DECLARE_ARRAY(struct stmt*, v);
+	DECLARE_SMALL_ARRAY(struct stmt*, v, STMTS_INLINE);
 };
 
-struct expr *new_num_expr(double num);
-struct expr *new_binary_expr(int tok, struct expr *lhs, struct expr *rhs);
-struct expr *new_ident_expr(char *beg, int len);
-struct expr *new_call_expr(struct expr *ident, struct args *args);
+struct parser_context;
+
+struct expr *new_num_expr(struct parser_context *ctx, double num);
+struct expr *new_binary_expr(struct parser_context *ctx, int tok, struct expr *lhs, struct expr *rhs);
+struct expr *new_ident_expr(struct parser_context *ctx, unsigned sym);
+struct expr *new_call_expr(struct parser_context *ctx, struct expr *ident, struct args *args);
 
-struct stmt *new_expr_stmt(struct expr *e);
-struct stmt *new_assign_stmt(struct expr *ident, struct expr *rhs);
-struct stmt *new_block_stmt(struct stmts *block);
-struct stmt *new_ifelse_stmt(struct expr *cond, struct stmt *b1, struct stmt *b2);
-struct stmt *new_for_stmt(struct expr *cond, struct stmt *block);
-struct stmt *new_func_stmt(struct expr *ident, struct args *args, struct stmt *b);
-struct stmt *new_var_stmt(struct expr *ident, struct expr *init);
-struct stmt *new_return_stmt(struct expr *e);
+struct stmt *new_expr_stmt(struct parser_context *ctx, struct expr *e);
+struct stmt *new_assign_stmt(struct parser_context *ctx, struct expr *ident, struct expr *rhs);
+struct stmt *new_block_stmt(struct parser_context *ctx, struct stmts *block);
+struct stmt *new_ifelse_stmt(struct parser_context *ctx, struct expr *cond, struct stmt *b1, struct stmt *b2);
+struct stmt *new_for_stmt(struct parser_context *ctx, struct expr *cond, struct stmt *block);
+struct stmt *new_func_stmt(struct parser_context *ctx, struct expr *ident, struct args *args, struct stmt *b);
+int func_modifier(struct parser_context *ctx, unsigned sym);
+struct stmt *new_var_stmt(struct parser_context *ctx, struct expr *ident, struct expr *init);
+struct stmt *new_return_stmt(struct parser_context *ctx, struct expr *e);
 
-struct stmts *new_stmts(struct stmt *s);
-struct args *new_args(struct expr *e);
+struct stmts *new_stmts(struct parser_context *ctx, struct stmt *s);
+struct args *new_args(struct parser_context *ctx, struct expr *e);
+void append_stmt(struct parser_context *ctx, struct stmts *ss, struct stmt *s);
+void append_arg(struct parser_context *ctx, struct args *aa, struct expr *e);
 
 void print_ast(struct stmts *top);
+size_t fold_ast(struct stmts *top, int fast_math);
+size_t prune_functions(struct stmts *top, const unsigned *roots, size_t nroots);
+
+struct binding {
+	// all functions in the program order, a definition takes the place of
+	// its foreign declaration
+	DECLARE_ARRAY(struct stmt*, funcs);
+
+	// copies of shared nodes, which are bound differently at some places
+	struct arena arena;
+};
+int bind_ast(struct binding *b, struct stmts *top);
+void free_binding(struct binding *b);
+size_t infer_types(struct binding *b, const unsigned *roots, size_t nroots);
+
+//------------------------------------------------------------------------------
+// Flat AST, the same tree stored in preorder in a few parallel arrays. Nodes
+// refer to each other by 32-bit index, children immediately follow their
+// parent and next[i] is the index right past the subtree of the node i.
+// Expression statements are plain expression nodes inside a block.
+//------------------------------------------------------------------------------
+
+enum flat_kind {
+	FLAT_NUM,    // data: index into 'nums'
+	FLAT_BIN,    // data: token; children: lhs, rhs
+	FLAT_IDENT,  // data: symbol
+	FLAT_CALL,   // data: symbol; children: args
+	FLAT_ASSIGN, // children: ident, rhs
+	FLAT_BLOCK,  // children: stmts
+	FLAT_IFELSE, // children: cond, block, optional else block
+	FLAT_FOR,    // children: cond, block
+	FLAT_FUNC,   // data: number of args | FLAT_FAST; children: ident, args, optional block
+	FLAT_VAR,    // children: ident, optional init
+	FLAT_RETURN, // children: optional expr
+};
+
+// a function of the binder's table, see flatten_bound
+struct flat_func {
+	unsigned sym;
+	unsigned nargs;
+	unsigned nslots;
+	unsigned types; // index of its slot types in 'types', args first
+	enum value_type rettype;
+};
+
+struct flat_ast {
+	unsigned char *kind;
+	unsigned *data;
+	unsigned *next;
+	size_t n;
+	size_t alloc;
+
+	DECLARE_ARRAY(double, nums);
+
+	// set by flatten_bound, the binding and the types of a bound tree:
+	// 'bound' is per node (see FLAT_BOUND_FUNC), 'funcs' is indexed like
+	// the binder's functions
+	unsigned *bound;
+	DECLARE_ARRAY(struct flat_func, funcs);
+	DECLARE_ARRAY(enum value_type, types);
+
+	// set if the arrays point into a mapped AST cache file
+	void *map;
+	size_t map_len;
+};
+
+// set in the data of a fast-math FLAT_FUNC
+#define FLAT_FAST 0x80000000u
+
+// bound[i] is an index and flags:
+//   FLAT_IDENT, FLAT_CALL  slot or function index, FLAT_BOUND_FUNC if it's
+//                          a function
+//   FLAT_BIN               FLAT_BOUND_WIDE (see struct expr), a shared
+//                          node has FLAT_BOUND_SHARED and the index of its
+//                          first copy in the flat AST
+#define FLAT_BOUND_FUNC   0x80000000u
+#define FLAT_BOUND_WIDE   0x80000000u
+#define FLAT_BOUND_SHARED 0x40000000u
+#define FLAT_BOUND_INDEX  0x3fffffffu
+
+static inline unsigned flat_func_nargs(struct flat_ast *fa, unsigned i)
+{
+	return fa->data[i] & ~FLAT_FAST;
+}
+
+// function without a body is a foreign declaration
+static inline int flat_func_has_body(struct flat_ast *fa, unsigned i)
+{
+	return fa->next[i] > i + 2 + flat_func_nargs(fa, i);
+}
+
+struct flat_ast *flatten_ast(struct stmts *top);
+struct flat_ast *flatten_bound(struct stmts *top, struct binding *b);
+void free_flat_ast(struct flat_ast *fa);
+size_t flat_ast_bytes(struct flat_ast *fa);
+void print_flat_ast(struct flat_ast *fa);
+
+// AST cache, see cache.c
+uint64_t hash_source(const char *buf, size_t len);
+int save_ast_cache(const char *path, struct flat_ast *fa, uint64_t hash, size_t source_len);
+struct flat_ast *load_ast_cache(const char *path, uint64_t hash, size_t source_len);
 
 //------------------------------------------------------------------------------
 
+// token as it is queued by the scanner in batch mode
+struct lexed_token {
+	struct token tok;
+	char *ts;
+	int line;
+};
+
+struct cons_slot {
+	struct expr *e;
+	unsigned gen;
+};
+
 struct parser_context {
 	void *lemon;
+	const char *filename; // optional, for error messages
+	struct stmts *result;
 
 	int line;
 	int lasttoken;
 	char *ts;
+	int failed; // a syntax error was reported
 
 	char *buf;
+	char *end;
+
+	// line index built by the scanner, offsets are from the start of the
+	// input (which may be over 4 GiB), 'buf' is at 'base' (the streaming
+	// lexer moves it)
+	DECLARE_ARRAY(size_t, lines);
+	size_t base;
+
+	// batch mode, the scanner fills 'tokens' and the parser drains it
+	int batch;
+	DECLARE_ARRAY(struct lexed_token, tokens);
+	size_t ntokens;
+
+	// all AST nodes are allocated here and freed together after codegen,
+	// except for lists which outgrew their inline storage
+	struct arena arena;
+	size_t nodes;
+	DECLARE_ARRAY(struct stmts*, spilled_stmts);
+	DECLARE_ARRAY(struct args*, spilled_args);
+
+	// hash-consing table of the current function, slots from earlier
+	// functions have an older 'gen' and count as empty
+	struct cons_slot *cons;
+	size_t cons_n;
+	size_t cons_alloc;
+	unsigned cons_gen;
 };
+void shrink_ast(struct parser_context *ctx);
+void free_ast(struct parser_context *ctx);
+size_t line_offset(struct parser_context *ctx, int line);
+int offset_line(struct parser_context *ctx, size_t offset);
 void print_syntax_error(struct parser_context *ctx, const char *msg, ...);
 
-LLVMModuleRef codegen(struct stmts *ss);
+struct stmts *unflatten_ast(struct parser_context *ctx, struct flat_ast *fa);
+
+// scanner, see lexer.rl
+void init_context(struct parser_context *ctx);
+void free_context(struct parser_context *ctx);
+void parse_buffer(struct parser_context *ctx, char *buf, size_t len);
+void parse_stream(struct parser_context *ctx, int fd);
+
+// the module is created in 'context', see codegen.cpp; codegen_flat takes
+// the flat AST of flatten_bound
+LLVMModuleRef codegen(LLVMContextRef context, struct stmts *ss, struct binding *b);
+LLVMModuleRef codegen_part(LLVMContextRef context, struct binding *b,
+			   const unsigned *funcs, size_t nfuncs);
+LLVMModuleRef codegen_flat(LLVMContextRef context, struct flat_ast *fa);
+int codegen_start_threads(void);
+
+// Code for the host machine and 'cpu' ("native" is the host's), see the end
+// of codegen.cpp. codegen_init_target is called once, after
+// LLVMInitializeNativeTarget. codegen_target sets the module's triple and
+// data layout, codegen_emit writes its assembly.
+void codegen_init_target(void);
+int codegen_target(LLVMModuleRef module, const char *cpu);
+int codegen_emit(LLVMModuleRef module, const char *cpu, const char *path);
+
+// Multiversioning, the program compiled for several CPUs, see codegen.cpp.
+// A module of codegen becomes clone 'clone' by codegen_clone, the dispatch
+// module picks one of 'nclones' at load time. codegen_cpu_features gives
+// the features the resolver checks for a CPU, 0 if it's not one a clone
+// can be compiled for.
+const char *codegen_cpu_features(const char *cpu);
+void codegen_clone(LLVMModuleRef module, struct binding *b,
+		   const unsigned *roots, size_t nroots, int clone);
+LLVMModuleRef codegen_dispatch(LLVMContextRef context, struct binding *b,
+			       const unsigned *roots, size_t nroots,
+			       const char **cpus, int nclones);
+
+// optimization pipeline of -O0 to -O3 or a list of passes, see passes.c
+LLVMPassManagerRef create_passes(int level, const char *custom);
+
+// Compiles a whole program from memory into a new module of 'context', see
+// compile.c. Errors are reported to stderr, the result is 0 then. Threads
+// may compile at the same time, each into a context of its own, after a
+// single call to compile_init.
+int compile_init(void);
+LLVMModuleRef compile(LLVMContextRef context, const char *source, size_t len);
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <string.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Transforms/Scalar.h>
+#include <llvm-c/Transforms/IPO.h>
+#include "parser.h"
+
+// Optimization pipelines. Passes are named the way opt names them, -O2 and
+// -O3 follow the standard module pipeline of LLVM.
+
+struct pass {
+	const char *name;
+	void (*add)(LLVMPassManagerRef pm);
+};
+
+static const struct pass passes[] = {
+	{"adce", LLVMAddAggressiveDCEPass},
+	{"argpromotion", LLVMAddArgumentPromotionPass},
+	{"constmerge", LLVMAddConstantMergePass},
+	{"constprop", LLVMAddConstantPropagationPass},
+	{"deadargelim", LLVMAddDeadArgEliminationPass},
+	{"dse", LLVMAddDeadStoreEliminationPass},
+	{"functionattrs", LLVMAddFunctionAttrsPass},
+	{"globaldce", LLVMAddGlobalDCEPass},
+	{"globalopt", LLVMAddGlobalOptimizerPass},
+	{"gvn", LLVMAddGVNPass},
+	{"indvars", LLVMAddIndVarSimplifyPass},
+	{"inline", LLVMAddFunctionInliningPass},
+	{"instcombine", LLVMAddInstructionCombiningPass},
+	{"jump-threading", LLVMAddJumpThreadingPass},
+	{"licm", LLVMAddLICMPass},
+	{"loop-deletion", LLVMAddLoopDeletionPass},
+	{"loop-rotate", LLVMAddLoopRotatePass},
+	{"loop-unroll", LLVMAddLoopUnrollPass},
+	{"loop-unswitch", LLVMAddLoopUnswitchPass},
+	{"mem2reg", LLVMAddPromoteMemoryToRegisterPass},
+	{"memcpyopt", LLVMAddMemCpyOptPass},
+	{"reassociate", LLVMAddReassociatePass},
+	{"sccp", LLVMAddSCCPPass},
+	{"simplifycfg", LLVMAddCFGSimplificationPass},
+	{"tailcallelim", LLVMAddTailCallEliminationPass},
+	{0, 0}
+};
+
+// -O2 and -O3 differ in argument promotion only
+#define MODULE_EARLY \
+	"globalopt,deadargelim,instcombine,simplifycfg,inline,functionattrs,"
+#define MODULE_LATE \
+	"instcombine,jump-threading,simplifycfg,instcombine,tailcallelim," \
+	"simplifycfg,reassociate,loop-rotate,licm,loop-unswitch,instcombine," \
+	"indvars,loop-deletion,loop-unroll,gvn,memcpyopt,sccp,instcombine," \
+	"jump-threading,dse,adce,simplifycfg,globaldce,constmerge"
+
+static const char *levels[] = {
+	"",
+	"constprop,instcombine,gvn,simplifycfg",
+	MODULE_EARLY MODULE_LATE,
+	MODULE_EARLY "argpromotion," MODULE_LATE,
+};
+
+static const struct pass *find_pass(const char *name, size_t len)
+{
+	const struct pass *p;
+	for (p = passes; p->name; p++) {
+		if (strlen(p->name) == len && memcmp(p->name, name, len) == 0)
+			return p;
+	}
+	return 0;
+}
+
+// Adds the passes of a comma separated list, returns the number of unknown
+// names, each one is reported to stderr.
+static int add_passes(LLVMPassManagerRef pm, const char *list)
+{
+	int errors = 0;
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		const struct pass *p = find_pass(list, len);
+		if (p)
+			p->add(pm);
+		else if (len) {
+			fprintf(stderr, "Unknown pass: %.*s\n", (int)len, list);
+			errors++;
+		}
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	return errors;
+}
+
+// The pipeline of -O'level' (0 to 3), or the 'custom' list of passes if it
+// is given. Returns 0 if 'custom' has unknown passes.
+LLVMPassManagerRef create_passes(int level, const char *custom)
+{
+	LLVMPassManagerRef pm = LLVMCreatePassManager();
+	if (add_passes(pm, custom ? custom : levels[level])) {
+		LLVMDisposePassManager(pm);
+		return 0;
+	}
+	return pm;
+}
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include "parser.h"
+
+// Dead function elimination. Functions reachable from the roots through
+// calls (or identifiers, which call a function of no arguments) are kept,
+// other top-level function definitions are dropped before codegen.
+// References are collected by name, a local variable shadowing a function
+// keeps the function alive, which is merely conservative.
+
+struct reach {
+	unsigned *first;   // symbol -> index of its first definition + 1
+	unsigned *same;    // index -> next definition with the same name + 1
+	unsigned char *live; // by symbol
+	DECLARE_ARRAY(unsigned, work);
+};
+
+static void mark(struct reach *r, unsigned sym)
+{
+	if (!r->first[sym] || r->live[sym])
+		return;
+	r->live[sym] = 1;
+	ARRAY_APPEND(r->work, sym);
+}
+
+static void mark_expr(struct reach *r, struct expr *e)
+{
+	size_t i;
+	switch (e->type) {
+	case EXPR_BIN:
+		mark_expr(r, e->bin.lhs);
+		mark_expr(r, e->bin.rhs);
+		break;
+	case EXPR_IDENT:
+		mark(r, e->ident.sym);
+		break;
+	case EXPR_CALL:
+		mark(r, e->call.ident->ident.sym);
+		for (i = 0; i < e->call.args->v_n; i++)
+			mark_expr(r, e->call.args->v[i]);
+		break;
+	default:
+		break;
+	}
+}
+
+static void mark_stmts(struct reach *r, struct stmts *ss);
+
+static void mark_stmt(struct reach *r, struct stmt *s)
+{
+	switch (s->type) {
+	case STMT_EXPR:
+		mark_expr(r, s->expr);
+		break;
+	case STMT_ASSIGN:
+		mark_expr(r, s->assign.rhs);
+		break;
+	case STMT_BLOCK:
+		mark_stmts(r, s->block);
+		break;
+	case STMT_IFELSE:
+		mark_expr(r, s->ifelse.cond);
+		mark_stmts(r, s->ifelse.block->block);
+		if (s->ifelse.elseblock)
+			mark_stmts(r, s->ifelse.elseblock->block);
+		break;
+	case STMT_FOR:
+		mark_expr(r, s->forloop.cond);
+		mark_stmts(r, s->forloop.block->block);
+		break;
+	case STMT_FUNC:
+		if (s->func.block)
+			mark_stmts(r, s->func.block->block);
+		break;
+	case STMT_VAR:
+		if (s->var.init)
+			mark_expr(r, s->var.init);
+		break;
+	case STMT_RETURN:
+		if (s->ret)
+			mark_expr(r, s->ret);
+		break;
+	}
+}
+
+static void mark_stmts(struct reach *r, struct stmts *ss)
+{
+	size_t i;
+	for (i = 0; i < ss->v_n; i++)
+		mark_stmt(r, ss->v[i]);
+}
+
+static int is_func(struct stmt *s)
+{
+	return s->type == STMT_FUNC && s->func.block;
+}
+
+// Removes the function definitions not reachable from 'roots' (symbols)
+// from 'top', returns how many were removed. If none of the roots is
+// defined, there is nothing to start from and the program is left alone.
+size_t prune_functions(struct stmts *top, const unsigned *roots, size_t nroots)
+{
+	struct reach r;
+	unsigned nsyms = sym_count();
+	size_t i, j;
+
+	memset(&r, 0, sizeof(r));
+	r.first = calloc(nsyms, sizeof(unsigned));
+	r.same = calloc(top->v_n, sizeof(unsigned));
+	r.live = calloc(nsyms, 1);
+	INIT_ARRAY(r.work, 64);
+
+	// definitions by name, in order
+	for (i = top->v_n; i-- > 0;) {
+		struct stmt *s = top->v[i];
+		if (!is_func(s))
+			continue;
+		unsigned sym = s->func.ident->ident.sym;
+		r.same[i] = r.first[sym];
+		r.first[sym] = i + 1;
+	}
+
+	for (i = 0; i < nroots; i++)
+		mark(&r, roots[i]);
+
+	size_t removed = 0;
+	if (r.work_n) {
+		// other top-level statements are kept, so is everything they use
+		for (i = 0; i < top->v_n; i++) {
+			if (!is_func(top->v[i]))
+				mark_stmt(&r, top->v[i]);
+		}
+		while (r.work_n) {
+			unsigned sym = r.work[--r.work_n];
+			for (j = r.first[sym]; j; j = r.same[j-1])
+				mark_stmts(&r, top->v[j-1]->func.block->block);
+		}
+
+		for (i = 0, j = 0; i < top->v_n; i++) {
+			struct stmt *s = top->v[i];
+			if (is_func(s) && !r.live[s->func.ident->ident.sym])
+				removed++;
+			else
+				top->v[j++] = s;
+		}
+		top->v_n = j;
+	}
+
+	FREE_ARRAY(r.work);
+	free(r.live);
+	free(r.same);
+	free(r.first);
+	return removed;
+}
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "source.h"
+
+static int source_map(struct source *src, int fd, size_t len)
+{
+	void *mem = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+	madvise(mem, len, MADV_SEQUENTIAL);
+
+	src->buf = mem;
+	src->len = len;
+	src->mapped = 1;
+	return 0;
+}
+
+int source_open(struct source *src, const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return -1;
+
+	int err = source_read(src, f);
+	fclose(f);
+	return err;
+}
+
+int source_read(struct source *src, FILE *f)
+{
+	struct stat st;
+	int fd = fileno(f);
+
+	src->buf = 0;
+	src->len = 0;
+	src->mapped = 0;
+
+	// empty files can't be mapped, fall through to the read loop for them
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		if (source_map(src, fd, st.st_size) == 0)
+			return 0;
+	}
+
+	size_t alloc = 65536;
+	char *buf = malloc(alloc);
+	for (;;) {
+		if (src->len == alloc) {
+			alloc *= 2;
+			buf = realloc(buf, alloc);
+		}
+		size_t n = fread(buf + src->len, 1, alloc - src->len, f);
+		if (n == 0)
+			break;
+		src->len += n;
+	}
+	if (ferror(f)) {
+		free(buf);
+		return -1;
+	}
+	src->buf = buf;
+	return 0;
+}
+
+void source_close(struct source *src)
+{
+	if (src->mapped)
+		munmap(src->buf, src->len);
+	else
+		free(src->buf);
+	src->buf = 0;
+	src->len = 0;
+	src->mapped = 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Source code buffer. Regular files are mapped into memory as is, pipes and
+// terminals are read into a growing heap buffer. Identifiers are interned
+// and numbers converted as they are scanned, the AST doesn't point into
+// 'buf'. It only has to outlive parsing and the syntax errors it reports.
+struct source {
+	char *buf;
+	size_t len;
+	int mapped;
+};
+
+int source_open(struct source *src, const char *filename);
+int source_read(struct source *src, FILE *f);
+void source_close(struct source *src);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
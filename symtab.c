@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "parser.h"
+
+// Global identifier table. Symbols are numbered densely from 0 in the order
+// they are first seen. Entries live in fixed size blocks which are never
+// moved, so sym_name() and sym_len() don't need a lock even while other
+// parser threads keep interning.
+
+#define SYM_BLOCK_SHIFT 12
+#define SYM_BLOCK_SIZE (1 << SYM_BLOCK_SHIFT)
+#define SYM_BLOCKS 65536
+#define NAME_CHUNK 65536
+
+struct symbol {
+	const char *name;
+	int len;
+	uint32_t hash;
+};
+
+static struct symbol *blocks[SYM_BLOCKS];
+static unsigned nsyms;
+
+// open addressing, slots hold symbol + 1, zero means empty
+static unsigned *table;
+static unsigned table_size;
+
+static char *names;
+static size_t names_left;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_name(const char *beg, int len)
+{
+	uint32_t h = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)beg[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct symbol *get_symbol(unsigned sym)
+{
+	return &blocks[sym >> SYM_BLOCK_SHIFT][sym & (SYM_BLOCK_SIZE - 1)];
+}
+
+static const char *store_name(const char *beg, int len)
+{
+	if (names_left < (size_t)len + 1) {
+		names_left = len + 1 > NAME_CHUNK ? len + 1 : NAME_CHUNK;
+		names = malloc(names_left);
+	}
+	char *name = names;
+	memcpy(name, beg, len);
+	name[len] = '\0';
+	names += len + 1;
+	names_left -= len + 1;
+	return name;
+}
+
+static void grow_table(void)
+{
+	unsigned newsize = table_size ? table_size * 2 : 1024;
+	unsigned *newtable = calloc(newsize, sizeof(unsigned));
+	unsigned i;
+	for (i = 0; i < nsyms; i++) {
+		unsigned slot = get_symbol(i)->hash & (newsize - 1);
+		while (newtable[slot])
+			slot = (slot + 1) & (newsize - 1);
+		newtable[slot] = i + 1;
+	}
+	free(table);
+	table = newtable;
+	table_size = newsize;
+}
+
+unsigned intern(const char *beg, int len)
+{
+	uint32_t hash = hash_name(beg, len);
+
+	pthread_mutex_lock(&lock);
+	if (nsyms * 2 >= table_size)
+		grow_table();
+
+	unsigned slot = hash & (table_size - 1);
+	while (table[slot]) {
+		unsigned sym = table[slot] - 1;
+		struct symbol *s = get_symbol(sym);
+		if (s->hash == hash && s->len == len && memcmp(s->name, beg, len) == 0) {
+			pthread_mutex_unlock(&lock);
+			return sym;
+		}
+		slot = (slot + 1) & (table_size - 1);
+	}
+
+	unsigned sym = nsyms++;
+	if (!blocks[sym >> SYM_BLOCK_SHIFT])
+		blocks[sym >> SYM_BLOCK_SHIFT] = malloc(SYM_BLOCK_SIZE * sizeof(struct symbol));
+	struct symbol *s = get_symbol(sym);
+	s->name = store_name(beg, len);
+	s->len = len;
+	s->hash = hash;
+	table[slot] = sym + 1;
+	pthread_mutex_unlock(&lock);
+	return sym;
+}
+
+const char *sym_name(unsigned sym)
+{
+	return get_symbol(sym)->name;
+}
+
+int sym_len(unsigned sym)
+{
+	return get_symbol(sym)->len;
+}
+
+// other threads may be interning
+unsigned sym_count(void)
+{
+	pthread_mutex_lock(&lock);
+	unsigned n = nsyms;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
@@ -0,0 +1,664 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "parser.h"
+#include "grammar.h"
+
+// Type inference. Every value is a double as far as the language goes, but
+// variables, arguments and return values which provably hold integers of
+// less than 2^53 magnitude are given a 64-bit integer type instead. Within
+// that range integer arithmetic gives the same results as doubles, anything
+// which may leave it or be a -0 stays a double.
+//
+// The proof is an interval analysis: a value is approximated by a range and
+// whether it may be a non-integer, a NaN or a -0. A loop is run until the state at
+// its head stops growing, bounds which keep growing are widened to infinity
+// on the way. It is then narrowed, running the body from the state the
+// condition allows: a counter bounded by the `<` of its loop with a constant
+// step gets a finite range back. Functions are revisited when the ranges of
+// their arguments grow, their callers when the return range grows. These
+// are widened too after a few changes. The signatures of foreign functions,
+// main and the exported roots stay double, the outside world calls those.
+//
+// The typing that follows:
+//   variable    integer if every value it ever holds is proven exact
+//   + - *       in integers if both operands are integers and the result
+//               is proven exact, otherwise the node is marked wide and it
+//               is done in doubles
+//   /           double
+//   <           integer (0 or 1)
+
+// 2^53, integers below it are exact in a double
+#define EXACT_LIMIT 9007199254740992.0
+
+// changes of the arguments or the return range of a function before they
+// are widened
+#define WIDEN_AFTER 4
+
+// narrowing passes over a loop body
+#define NARROW_PASSES 2
+
+struct range {
+	double lo, hi; // empty if lo > hi
+	unsigned char frac; // may be a non-integer
+	unsigned char nan;  // may be a NaN
+	unsigned char negzero; // may be a -0, which an integer can't hold
+};
+
+struct func_info {
+	DECLARE_ARRAY(unsigned, callers);
+	struct range *args;  // incoming, joined over the call sites
+	struct range *slots; // every value a slot holds
+	struct range ret;
+	int changes;
+	int fixed;
+	int queued;
+};
+
+struct infer {
+	struct binding *b;
+	struct func_info *info;
+	DECLARE_ARRAY(unsigned, queue);
+
+	// function being analyzed
+	unsigned cur;
+	struct stmt *f;
+	// set when values are recorded: slot ranges, wide nodes, arguments and
+	// returns. Loops are iterated without it and recorded once at the end.
+	int record;
+};
+
+static const struct range empty_range = {INFINITY, -INFINITY, 0, 0, 0};
+static const struct range any_range = {-INFINITY, INFINITY, 1, 1, 1};
+
+static int is_empty(struct range r)
+{
+	return r.lo > r.hi && !r.nan;
+}
+
+// see num_is_int in parser.h
+static int is_exact(struct range r)
+{
+	return !r.frac && !r.nan && !r.negzero && r.lo <= r.hi &&
+	       r.lo > -EXACT_LIMIT && r.hi < EXACT_LIMIT;
+}
+
+static struct range num_range(double num)
+{
+	struct range r = {num, num, num != floor(num), 0, num == 0 && signbit(num)};
+	if (isnan(num))
+		return (struct range){INFINITY, -INFINITY, 0, 1, 0};
+	return r;
+}
+
+static struct range join(struct range a, struct range b)
+{
+	a.lo = fmin(a.lo, b.lo);
+	a.hi = fmax(a.hi, b.hi);
+	a.frac |= b.frac;
+	a.nan |= b.nan;
+	a.negzero |= b.negzero;
+	return a;
+}
+
+// 'a' is within 'b'
+static int within(struct range a, struct range b)
+{
+	if (a.frac > b.frac || a.nan > b.nan || a.negzero > b.negzero)
+		return 0;
+	return a.lo > a.hi || (b.lo <= a.lo && a.hi <= b.hi);
+}
+
+// 'next' is 'old' joined with something, bounds which grew go to infinity
+static struct range widen(struct range old, struct range next)
+{
+	if (old.lo > old.hi)
+		return next;
+	if (next.lo < old.lo)
+		next.lo = -INFINITY;
+	if (next.hi > old.hi)
+		next.hi = INFINITY;
+	return next;
+}
+
+static int may_be_inf(struct range r)
+{
+	return r.lo == -INFINITY || r.hi == INFINITY;
+}
+
+static int has_zero(struct range r)
+{
+	return r.lo <= 0 && 0 <= r.hi;
+}
+
+// 0 * inf is a NaN, but a bound of infinity only says the value is unbounded
+static double bound_mul(double a, double b)
+{
+	double p = a * b;
+	return isnan(p) ? 0 : p;
+}
+
+// Rounding is monotonic, so doing + - * on the bounds in doubles gives
+// bounds of the results.
+static struct range arith(int tok, struct range a, struct range b)
+{
+	struct range r;
+	double p[4];
+	int i;
+
+	switch (tok) {
+	case LESS:
+		return (struct range){0, 1, 0, 0, 0};
+	case DIVIDE:
+		return any_range;
+	}
+
+	r.frac = a.frac | b.frac;
+	r.nan = a.nan | b.nan;
+	r.negzero = 0;
+	if (a.lo > a.hi || b.lo > b.hi) {
+		r.lo = INFINITY;
+		r.hi = -INFINITY;
+		return r;
+	}
+
+	switch (tok) {
+	case PLUS:
+		r.lo = a.lo + b.lo;
+		r.hi = a.hi + b.hi;
+		// inf + -inf
+		if ((a.lo == -INFINITY && b.hi == INFINITY) ||
+		    (a.hi == INFINITY && b.lo == -INFINITY))
+			r.nan = 1;
+		// -0 + -0, any other sum of zeros is +0
+		r.negzero = a.negzero && b.negzero;
+		break;
+	case MINUS:
+		r.lo = a.lo - b.hi;
+		r.hi = a.hi - b.lo;
+		// inf - inf
+		if ((a.lo == -INFINITY && b.lo == -INFINITY) ||
+		    (a.hi == INFINITY && b.hi == INFINITY))
+			r.nan = 1;
+		// -0 - +0
+		r.negzero = a.negzero && has_zero(b);
+		break;
+	case TIMES:
+		p[0] = bound_mul(a.lo, b.lo);
+		p[1] = bound_mul(a.lo, b.hi);
+		p[2] = bound_mul(a.hi, b.lo);
+		p[3] = bound_mul(a.hi, b.hi);
+		r.lo = r.hi = p[0];
+		for (i = 1; i < 4; i++) {
+			r.lo = fmin(r.lo, p[i]);
+			r.hi = fmax(r.hi, p[i]);
+		}
+		// inf * 0
+		if ((may_be_inf(a) && has_zero(b)) || (may_be_inf(b) && has_zero(a)))
+			r.nan = 1;
+		// zero times a negative number, or -0 times a positive one
+		r.negzero = (has_zero(a) && b.lo < 0) || (has_zero(b) && a.lo < 0) ||
+			    (a.negzero && b.hi > 0) || (b.negzero && a.hi > 0);
+		break;
+	default:
+		return any_range;
+	}
+	if (isnan(r.lo))
+		r.lo = -INFINITY;
+	if (isnan(r.hi))
+		r.hi = INFINITY;
+	return r;
+}
+
+//-------------------------------------------------------------------------
+// States, the ranges of the slots of the function at a point
+//-------------------------------------------------------------------------
+
+static struct range *copy_state(struct infer *in, struct range *st)
+{
+	size_t size = in->f->func.nslots * sizeof(struct range);
+	struct range *c = malloc(size);
+	memcpy(c, st, size);
+	return c;
+}
+
+static void join_state(struct infer *in, struct range *st, struct range *other)
+{
+	size_t i;
+	for (i = 0; i < in->f->func.nslots; i++)
+		st[i] = join(st[i], other[i]);
+}
+
+static int state_within(struct infer *in, struct range *st, struct range *other)
+{
+	size_t i;
+	for (i = 0; i < in->f->func.nslots; i++) {
+		if (!within(st[i], other[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static void widen_state(struct infer *in, struct range *st, struct range *next)
+{
+	size_t i;
+	for (i = 0; i < in->f->func.nslots; i++)
+		st[i] = widen(st[i], join(st[i], next[i]));
+}
+
+//-------------------------------------------------------------------------
+
+static void enqueue(struct infer *in, unsigned func)
+{
+	if (in->info[func].queued || !in->b->funcs[func]->func.block)
+		return;
+	in->info[func].queued = 1;
+	ARRAY_APPEND(in->queue, func);
+}
+
+// joins 'r' into '*dst', widening once it changed too often
+static int grow(struct func_info *fi, struct range *dst, struct range r)
+{
+	struct range next = join(*dst, r);
+	if (within(next, *dst))
+		return 0;
+	if (fi->changes++ >= WIDEN_AFTER)
+		next = widen(*dst, next);
+	*dst = next;
+	return 1;
+}
+
+static void flow_arg(struct infer *in, unsigned func, size_t arg, struct range r)
+{
+	struct func_info *fi = &in->info[func];
+	if (fi->fixed || !in->record)
+		return;
+	if (grow(fi, &fi->args[arg], r))
+		enqueue(in, func);
+}
+
+static void flow_slot(struct infer *in, struct range *st, unsigned slot, struct range r)
+{
+	st[slot] = r;
+	if (in->record) {
+		struct range *s = &in->info[in->cur].slots[slot];
+		*s = join(*s, r);
+	}
+}
+
+static void flow_return(struct infer *in, struct range r)
+{
+	struct func_info *fi = &in->info[in->cur];
+	size_t i;
+	if (!in->record || !grow(fi, &fi->ret, r))
+		return;
+	for (i = 0; i < fi->callers_n; i++)
+		enqueue(in, fi->callers[i]);
+}
+
+static struct range call_range(struct infer *in, unsigned func)
+{
+	if (!in->b->funcs[func]->func.block)
+		return any_range;
+	return in->info[func].ret;
+}
+
+static struct range expr_range(struct infer *in, struct expr *e, struct range *st)
+{
+	struct range lhs, rhs, r;
+	size_t i;
+
+	switch (e->type) {
+	case EXPR_NUM:
+		return num_range(e->num);
+	case EXPR_IDENT:
+		if (e->ident.bind == BIND_LOCAL)
+			return st[e->ident.index];
+		return call_range(in, e->ident.index);
+	case EXPR_BIN:
+		lhs = expr_range(in, e->bin.lhs, st);
+		rhs = expr_range(in, e->bin.rhs, st);
+		r = arith(e->bin.tok, lhs, rhs);
+		if (in->record && e->bin.tok != DIVIDE && e->bin.tok != LESS &&
+		    !is_empty(r) && !is_exact(r))
+			e->wide = 1;
+		return r;
+	case EXPR_CALL:
+	{
+		unsigned func = e->call.ident->ident.index;
+		for (i = 0; i < e->call.args->v_n; i++)
+			flow_arg(in, func, i, expr_range(in, e->call.args->v[i], st));
+		return call_range(in, func);
+	}
+	}
+	return any_range;
+}
+
+static int local_slot(struct expr *e)
+{
+	if (e->type == EXPR_IDENT && e->ident.bind == BIND_LOCAL)
+		return (int)e->ident.index;
+	return -1;
+}
+
+// Narrows the variables compared by 'cond' to the branch where it is
+// 'taken' or not. Only a < b tells anything.
+static void refine(struct infer *in, struct range *st, struct expr *cond, int taken)
+{
+	if (cond->type != EXPR_BIN || cond->bin.tok != LESS)
+		return;
+
+	int record = in->record;
+	in->record = 0;
+	struct range a = expr_range(in, cond->bin.lhs, st);
+	struct range b = expr_range(in, cond->bin.rhs, st);
+	in->record = record;
+
+	if (taken) {
+		// a < b, or either is a NaN (the compare is unordered)
+		if (a.nan || b.nan)
+			return;
+		a.hi = fmin(a.hi, a.frac ? b.hi : ceil(b.hi) - 1);
+		b.lo = fmax(b.lo, b.frac ? a.lo : floor(a.lo) + 1);
+	} else {
+		// a >= b, and neither is a NaN
+		a.nan = b.nan = 0;
+		a.lo = fmax(a.lo, b.lo);
+		b.hi = fmin(b.hi, a.hi);
+	}
+
+	int slot = local_slot(cond->bin.lhs);
+	if (slot >= 0)
+		st[slot] = a;
+	slot = local_slot(cond->bin.rhs);
+	if (slot >= 0)
+		st[slot] = b;
+}
+
+static int infer_stmts(struct infer *in, struct stmts *ss, struct range *st);
+
+// returns 1 if both branches return
+static int infer_ifelse(struct infer *in, struct stmt *s, struct range *st)
+{
+	struct expr *cond = s->ifelse.cond;
+	expr_range(in, cond, st);
+
+	struct range *other = copy_state(in, st);
+	refine(in, st, cond, 1);
+	int terminated = infer_stmts(in, s->ifelse.block->block, st);
+	refine(in, other, cond, 0);
+	int elseterminated = s->ifelse.elseblock &&
+		infer_stmts(in, s->ifelse.elseblock->block, other);
+
+	if (terminated && !elseterminated)
+		memcpy(st, other, in->f->func.nslots * sizeof(struct range));
+	else if (!terminated && !elseterminated)
+		join_state(in, st, other);
+	free(other);
+	return terminated && elseterminated;
+}
+
+// 'st' is the state at the loop head
+static void infer_forloop(struct infer *in, struct stmt *s, struct range *st)
+{
+	struct expr *cond = s->forloop.cond;
+	struct stmts *body = s->forloop.block->block;
+	size_t size = in->f->func.nslots * sizeof(struct range);
+	struct range *entry = copy_state(in, st);
+	struct range *next = copy_state(in, st);
+	struct range *b = copy_state(in, st);
+	int record = in->record;
+	int i;
+
+	in->record = 0;
+	for (;;) {
+		memcpy(b, st, size);
+		refine(in, b, cond, 1);
+		memcpy(next, entry, size);
+		if (!infer_stmts(in, body, b))
+			join_state(in, next, b);
+		if (state_within(in, next, st))
+			break;
+		widen_state(in, st, next);
+	}
+	for (i = 0; i < NARROW_PASSES; i++) {
+		memcpy(b, st, size);
+		refine(in, b, cond, 1);
+		memcpy(next, entry, size);
+		if (!infer_stmts(in, body, b))
+			join_state(in, next, b);
+		memcpy(st, next, size);
+	}
+	in->record = record;
+
+	if (record) {
+		expr_range(in, cond, st);
+		memcpy(b, st, size);
+		refine(in, b, cond, 1);
+		infer_stmts(in, body, b);
+	}
+	refine(in, st, cond, 0);
+	free(entry);
+	free(next);
+	free(b);
+}
+
+// returns 1 if the statements return, the rest is never reached
+static int infer_stmts(struct infer *in, struct stmts *ss, struct range *st)
+{
+	size_t i;
+	for (i = 0; i < ss->v_n; i++) {
+		struct stmt *s = ss->v[i];
+		switch (s->type) {
+		case STMT_EXPR:
+			expr_range(in, s->expr, st);
+			break;
+		case STMT_ASSIGN:
+			flow_slot(in, st, s->assign.ident->ident.index,
+				  expr_range(in, s->assign.rhs, st));
+			break;
+		case STMT_BLOCK:
+			if (infer_stmts(in, s->block, st))
+				return 1;
+			break;
+		case STMT_IFELSE:
+			if (infer_ifelse(in, s, st))
+				return 1;
+			break;
+		case STMT_FOR:
+			infer_forloop(in, s, st);
+			break;
+		case STMT_FUNC:
+			break;
+		case STMT_VAR:
+			// no initializer means zero
+			flow_slot(in, st, s->var.ident->ident.index, s->var.init ?
+				  expr_range(in, s->var.init, st) : num_range(0));
+			break;
+		case STMT_RETURN:
+			flow_return(in, s->ret ? expr_range(in, s->ret, st) : num_range(0));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void infer_func(struct infer *in)
+{
+	struct func_info *fi = &in->info[in->cur];
+	size_t nargs = in->f->func.args ? in->f->func.args->v_n : 0;
+	struct range *st = malloc(in->f->func.nslots * sizeof(struct range));
+	size_t i;
+
+	for (i = 0; i < in->f->func.nslots; i++)
+		st[i] = i < nargs ? fi->args[i] : empty_range;
+	for (i = 0; i < nargs; i++)
+		fi->slots[i] = join(fi->slots[i], st[i]);
+
+	in->record = 1;
+	// falling off the end returns zero
+	if (!infer_stmts(in, in->f->func.block->block, st))
+		flow_return(in, num_range(0));
+	free(st);
+}
+
+//-------------------------------------------------------------------------
+// Call graph, the callers of every function
+//-------------------------------------------------------------------------
+
+static void add_caller(struct infer *in, unsigned func)
+{
+	struct func_info *fi = &in->info[func];
+	if (fi->callers_n && fi->callers[fi->callers_n-1] == in->cur)
+		return;
+	ARRAY_APPEND(fi->callers, in->cur);
+}
+
+static void callers_expr(struct infer *in, struct expr *e)
+{
+	size_t i;
+	switch (e->type) {
+	case EXPR_BIN:
+		callers_expr(in, e->bin.lhs);
+		callers_expr(in, e->bin.rhs);
+		break;
+	case EXPR_IDENT:
+		if (e->ident.bind == BIND_FUNC)
+			add_caller(in, e->ident.index);
+		break;
+	case EXPR_CALL:
+		add_caller(in, e->call.ident->ident.index);
+		for (i = 0; i < e->call.args->v_n; i++)
+			callers_expr(in, e->call.args->v[i]);
+		break;
+	default:
+		break;
+	}
+}
+
+static void callers_stmts(struct infer *in, struct stmts *ss)
+{
+	size_t i;
+	for (i = 0; i < ss->v_n; i++) {
+		struct stmt *s = ss->v[i];
+		switch (s->type) {
+		case STMT_EXPR:
+			callers_expr(in, s->expr);
+			break;
+		case STMT_ASSIGN:
+			callers_expr(in, s->assign.rhs);
+			break;
+		case STMT_BLOCK:
+			callers_stmts(in, s->block);
+			break;
+		case STMT_IFELSE:
+			callers_expr(in, s->ifelse.cond);
+			callers_stmts(in, s->ifelse.block->block);
+			if (s->ifelse.elseblock)
+				callers_stmts(in, s->ifelse.elseblock->block);
+			break;
+		case STMT_FOR:
+			callers_expr(in, s->forloop.cond);
+			callers_stmts(in, s->forloop.block->block);
+			break;
+		case STMT_FUNC:
+			break;
+		case STMT_VAR:
+			if (s->var.init)
+				callers_expr(in, s->var.init);
+			break;
+		case STMT_RETURN:
+			if (s->ret)
+				callers_expr(in, s->ret);
+			break;
+		}
+	}
+}
+
+//-------------------------------------------------------------------------
+
+static int is_root(unsigned sym, const unsigned *roots, size_t nroots)
+{
+	size_t i;
+	for (i = 0; i < nroots; i++) {
+		if (roots[i] == sym)
+			return 1;
+	}
+	return 0;
+}
+
+// Types the functions of 'b' (which has to be bound), returns the number of
+// integer typed variables. Without any root defined every function may be
+// called from the outside and all signatures stay double.
+size_t infer_types(struct binding *b, const unsigned *roots, size_t nroots)
+{
+	struct infer in;
+	size_t i, j, ints = 0;
+	int anyroot = 0;
+
+	memset(&in, 0, sizeof(in));
+	in.b = b;
+	in.info = calloc(b->funcs_n, sizeof(struct func_info));
+	size_t nfuncs = b->funcs_n;
+	INIT_ARRAY(in.queue, nfuncs);
+
+	for (i = 0; i < b->funcs_n; i++) {
+		struct stmt *f = b->funcs[i];
+		if (f->func.block && is_root(f->func.ident->ident.sym, roots, nroots))
+			anyroot = 1;
+	}
+
+	for (i = 0; i < b->funcs_n; i++) {
+		struct stmt *f = b->funcs[i];
+		struct func_info *fi = &in.info[i];
+		if (!f->func.block) {
+			fi->fixed = 1;
+			f->func.rettype = TYPE_DOUBLE;
+			continue;
+		}
+		fi->fixed = !anyroot || is_root(f->func.ident->ident.sym, roots, nroots);
+
+		size_t nargs = f->func.args ? f->func.args->v_n : 0;
+		fi->args = malloc(nargs * sizeof(struct range));
+		for (j = 0; j < nargs; j++)
+			fi->args[j] = fi->fixed ? any_range : empty_range;
+		fi->slots = malloc(f->func.nslots * sizeof(struct range));
+		for (j = 0; j < f->func.nslots; j++)
+			fi->slots[j] = empty_range;
+		fi->ret = empty_range;
+
+		in.cur = i;
+		callers_stmts(&in, f->func.block->block);
+		enqueue(&in, i);
+	}
+
+	for (i = 0; i < in.queue_n; i++) {
+		in.cur = in.queue[i];
+		in.f = b->funcs[in.cur];
+		in.info[in.cur].queued = 0;
+		infer_func(&in);
+	}
+
+	// fixed signatures stay double, a slot nothing reaches too
+	for (i = 0; i < b->funcs_n; i++) {
+		struct stmt *f = b->funcs[i];
+		struct func_info *fi = &in.info[i];
+		FREE_ARRAY(fi->callers);
+		if (!f->func.block)
+			continue;
+
+		size_t nargs = f->func.args ? f->func.args->v_n : 0;
+		f->func.types = arena_alloc(&b->arena, f->func.nslots * sizeof(enum value_type));
+		for (j = 0; j < f->func.nslots; j++) {
+			int exact = is_exact(fi->slots[j]) && !(j < nargs && fi->fixed);
+			f->func.types[j] = exact ? TYPE_INT : TYPE_DOUBLE;
+			ints += exact;
+		}
+		f->func.rettype = is_exact(fi->ret) && !fi->fixed ? TYPE_INT : TYPE_DOUBLE;
+		free(fi->args);
+		free(fi->slots);
+	}
+	FREE_ARRAY(in.queue);
+	free(in.info);
+	return ints;
+}